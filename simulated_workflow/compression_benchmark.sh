@@ -0,0 +1,58 @@
+#!/bin/sh
+
+#Compares the ways perms2h5 can store the perms (no compression, or
+#-c with each --codec) on a dump from permute.sh: how long perms2h5
+#takes to write the file, how big it is, and how long esmk takes to
+#read (and decompress) the perms back.  Codecs that perms2h5 was built
+#without are skipped.
+#
+#usage: compression_benchmark.sh [dump] [bim] [ld]
+#
+#NRECORDS is perms2h5's -n and ESMK_ARGS the settings of the esmk run,
+#which reads each set of windows when it needs it (--prefetch 0), so
+#the reads are timed on their own.  The files are removed afterwards;
+#the logs are kept.
+
+DUMP=${1:-fake.1.mperm.dump.all}
+BIM=${2:-fake.bim}
+LD=${3:-fake.1.ld}
+NRECORDS=${NRECORDS:-1000}
+ESMK_ARGS=${ESMK_ARGS:-"-w 10000 -j 1000 -k 50 -n 20 -r 0.5"}
+
+now()
+{
+    date +%s.%N
+}
+
+printf "%-8s %9s %9s %9s %7s %9s %9s\n" codec "write s" "write MB/s" "size MB" ratio "read s" "read MB/s"
+for codec in none deflate lz4 zstd
+do
+    out=bench.$codec.perms.h5
+    if [ $codec = none ]
+    then
+	c=""
+    else
+	c="-c --codec $codec"
+    fi
+    t0=$(now)
+    if ! perms2h5 -i $DUMP -o $out -b $BIM -l $LD -n $NRECORDS $c 2> bench.$codec.log
+    then
+	echo "$codec: perms2h5 failed (not built in?), see bench.$codec.log"
+	rm -f $out
+	continue
+    fi
+    t1=$(now)
+    esmk -v --prefetch 0 -o bench.$codec.esmpv.txt $ESMK_ARGS $out 2> bench.$codec.esmk.log
+    read=$(sed -n 's/^Perms read and decompressed in \([0-9.e+-]*\) s.*/\1/p' bench.$codec.esmk.log)
+    size=$(wc -c < $out)
+    #the uncompressed file is the baseline of the ratio and the MB/s
+    if [ $codec = none ]
+    then
+	raw=$size
+    fi
+    echo $codec $t0 $t1 $size $raw $read | awk '{
+	mb = $5/1048576; w = $3 - $2;
+	printf "%-8s %9.2f %9.1f %9.1f %7.2f %9.2f %9.1f\n", $1, w, mb/w, $4/1048576, $5/$4, $6, ($6 > 0 ? mb/$6 : 0)
+    }'
+    rm -f $out
+done
@@ -4,7 +4,6 @@
 #module load krthornt/thorntonlab/1.0
 #WHICH LOADS:
 ##gcc/4.8.4
-##gsl/1.16
 ##htslib/1.2.1
 ##zlib/1.2.8
 ##boost/1.59.0
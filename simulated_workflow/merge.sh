@@ -13,7 +13,6 @@ PERM_FILES=$(echo fake.*.perms.h5)
 #module load krthornt/thorntonlab/1.0
 #WHICH LOADS:
 ##gcc/4.8.4
-##gsl/1.16
 ##htslib/1.2.1
 ##zlib/1.2.8
 ##boost/1.59.0
@@ -25,8 +24,11 @@ PERM_FILES=$(echo fake.*.perms.h5)
 
 #Modify as needed for your system                                                                                                                 
 #NEED:
-#python 2.7+ with h5py and numpy
+#hdf5
 
-#merge 10 perms at a time.
-python ~/ESMtest/src/h5merge.py -i $PERM_FILES -o fake_merged.all.perms.h5 -n 10
+#the perms of each file are copied over chunk by chunk, as they are stored
+h5merge -i $PERM_FILES -o fake_merged.all.perms.h5
+
+#or, to leave the perms where they are, write a view of them instead
+#h5merge --virtual -i $PERM_FILES -o fake_merged.all.perms.h5
 
@@ -0,0 +1,67 @@
+#ifndef __BoundedQueue_HPP__
+#define __BoundedQueue_HPP__
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <cstddef>
+
+/*
+  A first-in, first-out queue for handing items from one thread
+  to another.  push blocks while the queue holds capacity items,
+  which keeps a fast producer from running arbitrarily far ahead
+  of the consumer.
+
+  Once close is called, push fails and pop returns the items
+  still in the queue and then fails, so a consumer can simply do
+
+  while( Q.pop(item) ) { ... }
+*/
+template<typename T>
+class BoundedQueue
+{
+public:
+  explicit BoundedQueue( const std::size_t & capacity_ ) : capacity(capacity_ > 0 ? capacity_ : 1),
+							    closed(false)
+  {
+  }
+  //Blocks while the queue is full.  Returns false if the queue has been closed.
+  bool push( T item )
+  {
+    std::unique_lock<std::mutex> lock(m);
+    not_full.wait(lock,[this]{ return closed || items.size() < capacity; });
+    if( closed ) { return false; }
+    items.push_back(std::move(item));
+    not_empty.notify_one();
+    return true;
+  }
+  //Blocks while the queue is empty.  Returns false once the queue is closed and empty.
+  bool pop( T & item )
+  {
+    std::unique_lock<std::mutex> lock(m);
+    not_empty.wait(lock,[this]{ return closed || !items.empty(); });
+    if( items.empty() ) { return false; }
+    item = std::move(items.front());
+    items.pop_front();
+    not_full.notify_one();
+    return true;
+  }
+  //No more items will be pushed
+  void close( void )
+  {
+    std::lock_guard<std::mutex> lock(m);
+    closed = true;
+    not_empty.notify_all();
+    not_full.notify_all();
+  }
+private:
+  std::mutex m;
+  std::condition_variable not_empty,not_full;
+  std::deque<T> items;
+  const std::size_t capacity;
+  bool closed;
+  BoundedQueue( const BoundedQueue & );
+  BoundedQueue & operator=( const BoundedQueue & );
+};
+
+#endif
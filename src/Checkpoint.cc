@@ -0,0 +1,119 @@
+#include <Checkpoint.hpp>
+#include <iostream>
+#include <sstream>
+#include <limits>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace std;
+
+Checkpoint::Checkpoint( const string & filename_,
+			const string & run,
+			const bool & resume ) : filename(filename_),
+						log(),
+						m(),
+						done(),
+						nwindows(0)
+{
+  /*
+    The records are read back as far as the first one that is not
+    complete, and the good ones are written to a new log that
+    replaces the old one, so later records follow on cleanly.
+  */
+  ostringstream kept;
+  if( resume )
+    {
+      ifstream in(filename.c_str());
+      string line;
+      if( !getline(in,line) )
+	{
+	  cerr << "Error: there is no checkpoint " << filename << " to resume from.\n";
+	  exit(10);
+	}
+      if( line != run )
+	{
+	  cerr << "Error: checkpoint " << filename << " is from a run with different options:\n"
+	       << line << '\n';
+	  exit(10);
+	}
+      while( getline(in,line) )
+	{
+	  istringstream header(line);
+	  string tag,chr;
+	  int next_left;
+	  size_t n;
+	  if( !(header >> tag >> chr >> next_left >> n) || tag != "set" ) { break; }
+	  vector<ESMBASE> p(n),mid(n);
+	  vector<size_t> used(n);
+	  size_t i = 0;
+	  for( ; i < n && getline(in,line) ; ++i )
+	    {
+	      istringstream row(line);
+	      if( !(row >> p[i] >> mid[i] >> used[i]) ) { break; }
+	    }
+	  if( i < n || !getline(in,line) || line != "end" ) { break; }
+	  progress & P = done[chr];
+	  P.next_left = next_left;
+	  P.p_values.insert(P.p_values.end(),p.begin(),p.end());
+	  P.midpoints.insert(P.midpoints.end(),mid.begin(),mid.end());
+	  P.perms_used.insert(P.perms_used.end(),used.begin(),used.end());
+	  nwindows += n;
+	}
+    }
+  string tmpname = filename + ".tmp";
+  log.open(tmpname.c_str());
+  //enough digits that the values read back print the same as the originals
+  log.precision(numeric_limits<ESMBASE>::max_digits10);
+  log << run << '\n';
+  for( map<string,progress>::const_iterator i = done.begin() ; i != done.end() ; ++i )
+    {
+      const progress & P = i->second;
+      log << "set " << i->first << ' ' << P.next_left << ' ' << P.p_values.size() << '\n';
+      for( size_t j = 0 ; j < P.p_values.size() ; ++j )
+	{
+	  log << P.p_values[j] << ' ' << P.midpoints[j] << ' ' << P.perms_used[j] << '\n';
+	}
+      log << "end\n";
+    }
+  log.flush();
+  if( !log || rename(tmpname.c_str(),filename.c_str()) != 0 )
+    {
+      cerr << "Error: could not write checkpoint " << filename << ".\n";
+      exit(10);
+    }
+}
+
+const Checkpoint::progress * Checkpoint::resumed( const string & chr ) const
+{
+  map<string,progress>::const_iterator i = done.find(chr);
+  return (i == done.end()) ? nullptr : &i->second;
+}
+
+size_t Checkpoint::nresumed( void ) const
+{
+  return nwindows;
+}
+
+void Checkpoint::record( const string & chr,
+			 const int & next_left,
+			 const ESMBASE * p_values,
+			 const ESMBASE * midpoints,
+			 const size_t * perms_used,
+			 const size_t & n )
+{
+  lock_guard<mutex> lock(m);
+  log << "set " << chr << ' ' << next_left << ' ' << n << '\n';
+  for( size_t j = 0 ; j < n ; ++j )
+    {
+      log << p_values[j] << ' ' << midpoints[j] << ' ' << perms_used[j] << '\n';
+    }
+  log << "end\n";
+  log.flush();
+}
+
+void Checkpoint::remove( void )
+{
+  lock_guard<mutex> lock(m);
+  log.close();
+  std::remove(filename.c_str());
+}
@@ -0,0 +1,67 @@
+#ifndef __Checkpoint_HPP__
+#define __Checkpoint_HPP__
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstddef>
+#include <ESMH5type.hpp>
+
+/*
+  A log of the window sets that esmk has finished, so that a run
+  that is stopped part way through can pick up where it left off.
+
+  After each window set, record appends the set's results and the
+  left boundary of the chromosome's next set (the scan cursor) as a
+  short text record, and flushes it.  A record cut short by the job
+  being killed is ignored when the log is read back.
+
+  The first line of the log identifies the run (the options that
+  change the results), and a log is only resumed by a run with the
+  same first line.
+*/
+class Checkpoint
+{
+public:
+  //What has been done on one chromosome
+  struct progress
+  {
+    int next_left;
+    std::vector<ESMBASE> p_values,midpoints;
+    std::vector<std::size_t> perms_used;
+    progress( void ) : next_left(1) {}
+  };
+  /*
+    Starts a new log in filename, or with resume, reads the one that
+    is there and carries on with it.  Exits with an error if the log
+    to resume is for a different run.
+  */
+  Checkpoint( const std::string & filename,
+	      const std::string & run,
+	      const bool & resume );
+  //The progress read back on chromosome chr, or nullptr if there was none
+  const progress * resumed( const std::string & chr ) const;
+  //The number of windows read back
+  std::size_t nresumed( void ) const;
+  //Logs the n results of a finished window set on chr, and where the next set starts.  Thread-safe.
+  void record( const std::string & chr,
+	       const int & next_left,
+	       const ESMBASE * p_values,
+	       const ESMBASE * midpoints,
+	       const std::size_t * perms_used,
+	       const std::size_t & n );
+  //Closes and deletes the log, once the output is written
+  void remove( void );
+private:
+  std::string filename;
+  std::ofstream log;
+  std::mutex m;
+  std::map<std::string,progress> done;
+  std::size_t nwindows;
+  Checkpoint( const Checkpoint & );
+  Checkpoint & operator=( const Checkpoint & );
+};
+
+#endif
@@ -0,0 +1,588 @@
+#include <DumpReader.hpp>
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+using namespace std;
+
+namespace
+{
+  const size_t BUFFERSIZE = size_t(1) << 24;
+  //how much of the map is parsed before it is let go
+  const size_t RELEASESIZE = size_t(1) << 26;
+  //compressed input is read INSIZE at a time, and handed on decompressed in blocks of BLOCKSIZE
+  const size_t INSIZE = size_t(1) << 20;
+  const size_t BLOCKSIZE = size_t(1) << 22;
+  //how many blocks the decompressor may get ahead
+  const size_t NBLOCKS = 4;
+
+  inline bool is_space( const char & c )
+  {
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+  }
+
+  //white space within a record
+  inline bool is_blank( const char & c )
+  {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+  }
+
+  inline bool is_digit( const char & c )
+  {
+    return c >= '0' && c <= '9';
+  }
+
+  //The powers of ten that a float holds exactly
+  const float pow10f[11] = { 1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f };
+
+  //strtof on the word [s,e), which is not NUL-terminated
+  bool slow_float( const char * s, const char * e, float & x )
+  {
+    char word[64];
+    if( e - s >= int(sizeof(word)) ) { return false; }
+    memcpy(word,s,e-s);
+    word[e-s] = '\0';
+    char * last;
+    x = strtof(word,&last);
+    return last == word + (e-s);
+  }
+
+  bool parse_float( const char * s, const char * e, float & x )
+  {
+    const char * t = s;
+    bool neg = false;
+    if( t < e && (*t == '-' || *t == '+') )
+      {
+	neg = (*t == '-');
+	++t;
+      }
+    //the digits, as an integer, and the power of ten they are scaled by
+    uint64_t m = 0;
+    int exp10 = 0, ndigits = 0;
+    bool overflow = false;
+    for( ; t < e && is_digit(*t) ; ++t, ++ndigits )
+      {
+	if( m < (uint64_t(1) << 59) ) { m = 10*m + uint64_t(*t - '0'); }
+	else { overflow = true; }
+      }
+    if( t < e && *t == '.' )
+      {
+	for( ++t ; t < e && is_digit(*t) ; ++t, ++ndigits )
+	  {
+	    if( m < (uint64_t(1) << 59) )
+	      {
+		m = 10*m + uint64_t(*t - '0');
+		--exp10;
+	      }
+	    else { overflow = true; }
+	  }
+      }
+    if( ndigits > 0 && t < e && (*t == 'e' || *t == 'E') )
+      {
+	const char * u = t + 1;
+	bool eneg = false;
+	if( u < e && (*u == '-' || *u == '+') )
+	  {
+	    eneg = (*u == '-');
+	    ++u;
+	  }
+	int ev = 0;
+	const char * first = u;
+	for( ; u < e && is_digit(*u) && ev < 100000 ; ++u )
+	  {
+	    ev = 10*ev + (*u - '0');
+	  }
+	if( u > first )
+	  {
+	    exp10 += eneg ? -ev : ev;
+	    t = u;
+	  }
+      }
+    if( ndigits == 0 || t != e || overflow || m >= (uint64_t(1) << 24) || exp10 < -10 || exp10 > 10 )
+      {
+	//inf, nan, hex, long mantissas and big exponents are left to the C library
+	return slow_float(s,e,x);
+      }
+    float v = float(m);
+    v = (exp10 < 0) ? v / pow10f[-exp10] : v * pow10f[exp10];
+    x = neg ? -v : v;
+    return true;
+  }
+
+  bool parse_int( const char * s, const char * e, long & x )
+  {
+    const char * t = s;
+    bool neg = false;
+    if( t < e && (*t == '-' || *t == '+') )
+      {
+	neg = (*t == '-');
+	++t;
+      }
+    if( t == e ) { return false; }
+    long v = 0;
+    for( ; t < e ; ++t )
+      {
+	if( !is_digit(*t) ) { return false; }
+	v = 10*v + (*t - '0');
+      }
+    x = neg ? -v : v;
+    return true;
+  }
+}
+
+DumpReader::DumpReader( const string & filename ) : fd(0),
+						    map(NULL),
+						    maplen(0),
+						    buffer(),
+						    blocks(NBLOCKS),
+						    decompressor(),
+						    error(),
+						    p(NULL),
+						    end(NULL),
+						    consumed(0),
+						    input_done(false),
+						    hit_end(false)
+{
+  if( !filename.empty() )
+    {
+      fd = open(filename.c_str(),O_RDONLY);
+      if( fd < 0 )
+	{
+	  cerr << "Error, input stream could not be opened.\n";
+	  exit(10);
+	}
+    }
+  /*
+    The first bytes say whether the input is compressed.  A regular
+    file is peeked at, but a stream has to be read, and what is read
+    goes ahead of the rest of it.
+  */
+  struct stat st;
+  const bool regular = fstat(fd,&st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0;
+  vector<char> head(4);
+  size_t nhead = 0;
+  while( nhead < head.size() )
+    {
+      const ssize_t n = regular ? pread(fd,head.data() + nhead,head.size() - nhead,off_t(nhead))
+	: read(fd,head.data() + nhead,head.size() - nhead);
+      if( n < 0 && errno == EINTR ) { continue; }
+      if( n <= 0 ) { break; }
+      nhead += size_t(n);
+    }
+  head.resize(nhead);
+  const unsigned char * magic = reinterpret_cast<const unsigned char *>(head.data());
+  compression c = NONE;
+  if( nhead >= 2 && magic[0] == 0x1f && magic[1] == 0x8b ) { c = GZIP; }
+  if( nhead >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd ) { c = ZSTD; }
+#ifndef HAVE_ZSTD
+  if( c == ZSTD )
+    {
+      cerr << "Error, the input is zstd-compressed, but perms2h5 was built without zstd.\n";
+      exit(10);
+    }
+#endif
+  if( c == NONE && regular )
+    {
+      void * m = mmap(NULL,size_t(st.st_size),PROT_READ,MAP_PRIVATE,fd,0);
+      if( m != MAP_FAILED )
+	{
+	  map = static_cast<char *>(m);
+	  maplen = size_t(st.st_size);
+	  madvise(map,maplen,MADV_SEQUENTIAL);
+	  p = map;
+	  end = map + maplen;
+	  input_done = true;
+	  return;
+	}
+    }
+  //not a regular file, it could not be mapped, or it is compressed: read it in
+  buffer.resize(BUFFERSIZE);
+  p = end = buffer.data();
+  if( regular )
+    {
+      //nothing has been read yet
+      head.clear();
+    }
+  if( c == NONE )
+    {
+      memcpy(buffer.data(),head.data(),head.size());
+      end += head.size();
+      return;
+    }
+  decompressor = thread(&DumpReader::decompress,this,c,head);
+}
+
+DumpReader::~DumpReader()
+{
+  if( decompressor.joinable() )
+    {
+      //if the input was not read to the end, the decompressor finds no one taking its blocks, and stops
+      blocks.close();
+      decompressor.join();
+    }
+  if( map != NULL )
+    {
+      munmap(map,maplen);
+    }
+  if( fd > 0 )
+    {
+      close(fd);
+    }
+}
+
+bool DumpReader::fill( void )
+{
+  if( input_done ) { return false; }
+  const size_t keep = end - p;
+  if( keep == buffer.size() )
+    {
+      //one record is bigger than the buffer
+      const size_t offset = p - buffer.data();
+      buffer.resize(2*buffer.size());
+      p = buffer.data() + offset;
+      end = p + keep;
+    }
+  consumed += p - buffer.data();
+  memmove(buffer.data(),p,keep);
+  p = buffer.data();
+  end = p + keep;
+  if( decompressor.joinable() )
+    {
+      vector<char> block;
+      if( !blocks.pop(block) )
+	{
+	  if( !error.empty() )
+	    {
+	      cerr << "Error, " << error << ".\n";
+	      exit(10);
+	    }
+	  input_done = true;
+	  return false;
+	}
+      if( keep + block.size() > buffer.size() )
+	{
+	  buffer.resize(keep + block.size());
+	  p = buffer.data();
+	  end = p + keep;
+	}
+      memcpy(buffer.data() + keep,block.data(),block.size());
+      end += block.size();
+      return true;
+    }
+  ssize_t n;
+  do
+    {
+      n = read(fd,buffer.data() + keep,buffer.size() - keep);
+    }
+  while( n < 0 && errno == EINTR );
+  if( n < 0 )
+    {
+      cerr << "Error, could not read the input: " << strerror(errno) << '\n';
+      exit(10);
+    }
+  if( n == 0 )
+    {
+      input_done = true;
+      return false;
+    }
+  end += n;
+  return true;
+}
+
+void DumpReader::release( void )
+{
+  if( map != NULL && size_t(p - map) - consumed >= RELEASESIZE )
+    {
+      //whole pages only; the one p is on is kept
+      const size_t page = size_t(sysconf(_SC_PAGESIZE));
+      const size_t upto = (size_t(p - map)/page)*page;
+      madvise(map + consumed,upto - consumed,MADV_DONTNEED);
+      consumed = upto;
+    }
+}
+
+void DumpReader::decompress( const compression c,
+			     vector<char> head )
+{
+  if( c == GZIP )
+    {
+      inflate_gzip(head);
+    }
+#ifdef HAVE_ZSTD
+  else
+    {
+      inflate_zstd(head);
+    }
+#endif
+  //error, if there is one, is seen once pop fails
+  blocks.close();
+}
+
+/*
+  Both decompressors only read more input once the last call stopped
+  for want of it, rather than for want of room for its output, so
+  nothing is left behind in the decompressor at the end.
+*/
+void DumpReader::inflate_gzip( vector<char> & in )
+{
+  z_stream zs;
+  memset(&zs,0,sizeof(zs));
+  //gzip headers only
+  if( inflateInit2(&zs,15+16) != Z_OK )
+    {
+      error = "could not start zlib";
+      return;
+    }
+  vector<char> out(BLOCKSIZE);
+  size_t pos = 0, filled = 0;
+  //member is true part way through a gzip member
+  bool member = false, more = false;
+  while( error.empty() )
+    {
+      if( pos == in.size() && !more )
+	{
+	  in.clear();
+	  pos = 0;
+	  if( read_input(in) == 0 )
+	    {
+	      if( member && error.empty() ) { error = "the gzip input is truncated"; }
+	      break;
+	    }
+	}
+      zs.next_in = reinterpret_cast<Bytef *>(in.data() + pos);
+      zs.avail_in = uInt(in.size() - pos);
+      zs.next_out = reinterpret_cast<Bytef *>(out.data() + filled);
+      zs.avail_out = uInt(out.size() - filled);
+      const int rc = inflate(&zs,Z_NO_FLUSH);
+      pos = in.size() - zs.avail_in;
+      filled = out.size() - zs.avail_out;
+      more = (filled == out.size());
+      if( rc == Z_STREAM_END )
+	{
+	  //another member may follow
+	  member = false;
+	  inflateReset(&zs);
+	}
+      else if( rc == Z_OK )
+	{
+	  member = true;
+	}
+      else if( rc != Z_BUF_ERROR )
+	{
+	  error = "the gzip input is corrupt";
+	}
+      if( more && !put_block(out,filled) ) { break; }
+    }
+  if( error.empty() && filled > 0 )
+    {
+      put_block(out,filled);
+    }
+  inflateEnd(&zs);
+}
+
+#ifdef HAVE_ZSTD
+void DumpReader::inflate_zstd( vector<char> & in )
+{
+  ZSTD_DStream * zs = ZSTD_createDStream();
+  if( zs == NULL || ZSTD_isError(ZSTD_initDStream(zs)) )
+    {
+      error = "could not start zstd";
+      ZSTD_freeDStream(zs);
+      return;
+    }
+  vector<char> out(BLOCKSIZE);
+  size_t pos = 0, filled = 0;
+  //left is 0 at the end of a frame
+  size_t left = 0;
+  bool more = false;
+  while( error.empty() )
+    {
+      if( pos == in.size() && !more )
+	{
+	  in.clear();
+	  pos = 0;
+	  if( read_input(in) == 0 )
+	    {
+	      if( left != 0 && error.empty() ) { error = "the zstd input is truncated"; }
+	      break;
+	    }
+	}
+      ZSTD_inBuffer zin = { in.data(), in.size(), pos };
+      ZSTD_outBuffer zout = { out.data(), out.size(), filled };
+      left = ZSTD_decompressStream(zs,&zout,&zin);
+      if( ZSTD_isError(left) )
+	{
+	  error = string("the zstd input is corrupt: ") + ZSTD_getErrorName(left);
+	  break;
+	}
+      pos = zin.pos;
+      filled = zout.pos;
+      more = (filled == out.size());
+      if( more && !put_block(out,filled) ) { break; }
+    }
+  if( error.empty() && filled > 0 )
+    {
+      put_block(out,filled);
+    }
+  ZSTD_freeDStream(zs);
+}
+#endif
+
+size_t DumpReader::read_input( vector<char> & in )
+{
+  const size_t have = in.size();
+  in.resize(have + INSIZE);
+  ssize_t n;
+  do
+    {
+      n = read(fd,in.data() + have,INSIZE);
+    }
+  while( n < 0 && errno == EINTR );
+  if( n < 0 )
+    {
+      error = string("could not read the input: ") + strerror(errno);
+      n = 0;
+    }
+  in.resize(have + size_t(n));
+  return size_t(n);
+}
+
+bool DumpReader::put_block( vector<char> & out,
+			    size_t & n )
+{
+  out.resize(n);
+  const bool taken = blocks.push(std::move(out));
+  out = vector<char>(BLOCKSIZE);
+  n = 0;
+  return taken;
+}
+
+bool DumpReader::next_word( const char * & word_end )
+{
+  while( true )
+    {
+      while( p < end && is_space(*p) ) { ++p; }
+      if( p < end ) { break; }
+      if( !fill() )
+	{
+	  hit_end = true;
+	  return false;
+	}
+    }
+  //the word may run on past what has been read so far
+  const char * q = p;
+  while( true )
+    {
+      while( q < end && !is_space(*q) ) { ++q; }
+      if( q < end ) { break; }
+      const size_t done = q - p;
+      if( !fill() )
+	{
+	  hit_end = true;
+	  break;
+	}
+      q = p + done;
+    }
+  word_end = q;
+  return true;
+}
+
+bool DumpReader::read_int( long & x )
+{
+  const char * e;
+  if( !next_word(e) || !parse_int(p,e,x) ) { return false; }
+  p = e;
+  //once a record, which is often enough
+  release();
+  return true;
+}
+
+bool DumpReader::read_float( float & x )
+{
+  const char * e;
+  if( !next_word(e) || !parse_float(p,e,x) ) { return false; }
+  p = e;
+  return true;
+}
+
+size_t DumpReader::read_records( const size_t & n,
+				 vector<char> & text )
+{
+  text.clear();
+  size_t k = 0;
+  while( k < n && !hit_end )
+    {
+      //blank lines are skipped, and running out here is not running into the end
+      while( true )
+	{
+	  while( p < end && is_space(*p) ) { ++p; }
+	  if( p < end ) { break; }
+	  if( !fill() ) { return k; }
+	}
+      const char * q;
+      while( true )
+	{
+	  q = static_cast<const char *>(memchr(p,'\n',end - p));
+	  if( q != NULL ) { break; }
+	  if( !fill() )
+	    {
+	      //as after fscanf, only if the last value runs right up to the end
+	      hit_end = !is_space(*(end-1));
+	      q = end;
+	      break;
+	    }
+	}
+      text.insert(text.end(),p,q);
+      text.push_back('\n');
+      p = q;
+      ++k;
+      release();
+    }
+  return k;
+}
+
+bool DumpReader::eof( void ) const
+{
+  return hit_end;
+}
+
+size_t DumpReader::bytes( void ) const
+{
+  return (map != NULL) ? size_t(p - map) : consumed + size_t(p - buffer.data());
+}
+
+bool parse_records( const char * begin,
+		    const char * end,
+		    const size_t & nrecords,
+		    const size_t & nmarkers,
+		    float * values )
+{
+  const char * p = begin;
+  for( size_t r = 0 ; r < nrecords ; ++r )
+    {
+      long repno;
+      for( size_t j = 0 ; j <= nmarkers ; ++j )
+	{
+	  while( p < end && is_blank(*p) ) { ++p; }
+	  const char * e = p;
+	  while( e < end && !is_space(*e) ) { ++e; }
+	  if( e == p ) { return false; }
+	  if( !(j == 0 ? parse_int(p,e,repno) : parse_float(p,e,values[r*nmarkers + j-1])) ) { return false; }
+	  p = e;
+	}
+      while( p < end && is_blank(*p) ) { ++p; }
+      if( p == end || *p != '\n' ) { return false; }
+      ++p;
+    }
+  return true;
+}
@@ -0,0 +1,106 @@
+#ifndef __DumpReader_HPP__
+#define __DumpReader_HPP__
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <cstddef>
+#include <BoundedQueue.hpp>
+
+/*
+  Reads the numbers in a PLINK *.mperm.dump.all file, which is
+  white-space separated text: each line is a replicate number and
+  then one chi^2 value per marker.
+
+  A regular file is mapped into memory, and its pages are let go
+  once they are parsed; anything else (stdin, a pipe) is read 16MB
+  at a time.  Numbers are parsed in place by a hand-written,
+  locale-free tokenizer rather than by scanf, which spends most of
+  its time interpreting the format string.
+
+  Input that starts with the gzip or zstd magic number, file or
+  stream, is decompressed as it is read (zstd only when built with
+  HAVE_ZSTD).  That is done on a thread of the reader's own, which
+  stays a few blocks ahead of the parsing.  Concatenated gzip
+  members and zstd frames are read one after the other, as gzip -d
+  and zstd -d do.
+
+  read_float gives the same float as scanf("%f").  When a value's
+  digits, read as an integer, are below 2^24 and its power of ten is
+  within 10 of zero (as for every value PLINK writes), it is
+  float(digits) times or divided by an exact power of ten, which
+  IEEE arithmetic rounds correctly.  Anything else goes to strtof.
+*/
+class DumpReader
+{
+public:
+  //Reads filename, or stdin if it is empty.  Exits with an error if it cannot be opened, or is corrupt.
+  explicit DumpReader( const std::string & filename );
+  ~DumpReader();
+  //Skip white space and read the next number.  false if the input has ended or the next word is not a number.
+  bool read_int( long & x );
+  bool read_float( float & x );
+  /*
+    Copies the next n records (non-blank lines) into text, each ending
+    in '\n', for parse_records.  Returns how many there were, which is
+    fewer than n only at the end of the input.
+  */
+  std::size_t read_records( const std::size_t & n,
+			    std::vector<char> & text );
+  /*
+    true once a read has run into the end of the input, as feof is
+    after fscanf.  For read_records, that is when the last record
+    runs up to the end of the input with no newline.
+  */
+  bool eof( void ) const;
+  //The number of bytes parsed so far
+  std::size_t bytes( void ) const;
+private:
+  enum compression { NONE, GZIP, ZSTD };
+  int fd;
+  char * map;
+  std::size_t maplen;
+  std::vector<char> buffer;
+  //Decompressed blocks, made by the decompressor thread, and why it stopped early, if it did
+  BoundedQueue< std::vector<char> > blocks;
+  std::thread decompressor;
+  std::string error;
+  const char * p, * end;
+  //bytes of the input before the start of buffer, or of the map that have been let go
+  std::size_t consumed;
+  bool input_done,hit_end;
+  //Finds the next word, [p,word_end), reading more input as needed.  false if there is none.
+  bool next_word( const char * & word_end );
+  //Keeps [p,end) and reads more input after it.  false if there is no more.
+  bool fill( void );
+  //Lets go of the pages of the map that have been parsed
+  void release( void );
+  //Run by the decompressor thread.  head is what has already been read of the input.
+  void decompress( const compression c,
+		   std::vector<char> head );
+  void inflate_gzip( std::vector<char> & in );
+#ifdef HAVE_ZSTD
+  void inflate_zstd( std::vector<char> & in );
+#endif
+  //Reads more of the compressed input into in, after what is there.  Returns the number of bytes read.
+  std::size_t read_input( std::vector<char> & in );
+  //Hands out the n decompressed bytes in out, and starts a new block.  false if the reader has gone.
+  bool put_block( std::vector<char> & out,
+		  std::size_t & n );
+  DumpReader( const DumpReader & );
+  DumpReader & operator=( const DumpReader & );
+};
+
+/*
+  Parses nrecords records of text [begin,end), as copied by
+  read_records, into values, which needs room for nrecords*nmarkers.
+  Returns false if a record is not a replicate number followed by
+  exactly nmarkers values.  Thread-safe.
+*/
+bool parse_records( const char * begin,
+		    const char * end,
+		    const std::size_t & nrecords,
+		    const std::size_t & nmarkers,
+		    float * values );
+
+#endif
@@ -0,0 +1,603 @@
+#include <ESMkernel.hpp>
+#include <algorithm>
+#include <cmath>
+#include <type_traits>
+#include <limits>
+#include <cstdint>
+
+/*
+  The SIMD kernels are built with per-function target attributes,
+  so the rest of the program does not need to be compiled with -mavx2,
+  and the widest one the CPU supports is picked at run time.
+*/
+#if defined(__GNUC__) && defined(__x86_64__)
+#define ESM_X86_KERNELS 1
+#include <immintrin.h>
+#if defined(__clang__) || __GNUC__ >= 5
+#define ESM_AVX512_KERNEL 1
+#endif
+#endif
+
+using namespace std;
+
+vector<ESMBASE> esm_offsets( const int & nmarkers,
+			     const int & K )
+{
+  vector<ESMBASE> rv( min(K,nmarkers) );
+  for ( int k = 0 ; k < int(rv.size()) ; ++k )
+    {
+      //critical that the denominator be nmarkers in the window NOT K
+      rv[k] = log10(((ESMBASE) k + 1) / (ESMBASE) nmarkers);
+    }
+  return rv;
+}
+
+ESMBASE esm_sum( const ESMBASE * top,
+		 const vector<ESMBASE> & offsets )
+{
+  ESMBASE ESM = 0;
+  for ( size_t k = 0 ; k < offsets.size() ; ++k )
+    {
+      ESM += top[k] + offsets[k];
+    }
+  return ESM;
+}
+
+/*
+  Put v into top, which is sorted in descending order,
+  starting from position i and shifting smaller values right.
+  Whatever was in top[i] on entry is overwritten.
+*/
+static inline void topk_insert( ESMBASE * top,
+				size_t i,
+				const ESMBASE & v )
+{
+  while( i > 0 && top[i-1] < v )
+    {
+      top[i] = top[i-1];
+      --i;
+    }
+  top[i] = v;
+}
+
+//The value of a perm, which is looked up in table if it is quantized
+static inline ESMBASE perm_value( const ESMBASE * p,
+				  const ESMBASE * )
+{
+  return *p;
+}
+
+static inline ESMBASE perm_value( const uint16_t * p,
+				  const ESMBASE * table )
+{
+  return table[*p];
+}
+
+template<typename D>
+static size_t esm_exceedances_scalar( const D * data,
+				      const ESMBASE * table,
+				      const size_t & nperms,
+				      const int & nmarkers,
+				      const size_t & stride,
+				      const short * keep,
+				      const vector<ESMBASE> & offsets,
+				      const ESMBASE & ESM_obs )
+{
+  const size_t K = offsets.size();
+  if( K == 0 ) { return 0; }
+  vector<ESMBASE> top( K );
+  size_t nexceed = 0;
+  for ( size_t j = 0 ; j < nperms ; ++j )
+    {
+      const D * perm = data + stride*j;
+      size_t n = 0;
+      for ( int k = 0 ; k < nmarkers ; ++k )
+	{
+	  ESMBASE v = perm_value(perm + k,table)*keep[k];
+	  if( n < K )
+	    {
+	      //still filling the buffer
+	      topk_insert(&top[0],n++,v);
+	    }
+	  else if ( v > top[K-1] )
+	    {
+	      //v displaces the smallest of the current top K
+	      topk_insert(&top[0],K-1,v);
+	    }
+	}
+      if( esm_sum(&top[0],offsets) >= ESM_obs )
+	{
+	  ++nexceed;
+	}
+    }
+  return nexceed;
+}
+
+/*
+  The largest values in the current window of one permutation,
+  sorted in descending order, for esm_scan_exceedances.
+
+  Every value in the window that is not in buf is <= buf[size-1],
+  and nwin is the number of values in the window, so the buffer
+  holds the whole window when size == nwin.  Values are only
+  compared, never told apart, so when a value equal to buf[size-1]
+  leaves the window it does not matter which copy is removed.
+*/
+struct esm_topbuffer
+{
+  vector<ESMBASE> buf;
+  size_t size,nwin;
+  esm_topbuffer( const size_t & capacity ) : buf(capacity),size(0),nwin(0)
+  {
+  }
+  inline void clear( void )
+  {
+    size = nwin = 0;
+  }
+  inline void insert( const ESMBASE & v )
+  {
+    if( size < buf.size() )
+      {
+	if( size == nwin || (size > 0 && v > buf[size-1]) )
+	  {
+	    topk_insert(&buf[0],size++,v);
+	  }
+      }
+    else if ( v > buf[size-1] )
+      {
+	topk_insert(&buf[0],size-1,v);
+      }
+    ++nwin;
+  }
+  inline void remove( const ESMBASE & v )
+  {
+    if( size > 0 && v >= buf[size-1] )
+      {
+	//v is in the buffer
+	size_t i = size-1;
+	while( buf[i] != v ) { --i; }
+	for( ; i + 1 < size ; ++i )
+	  {
+	    buf[i] = buf[i+1];
+	  }
+	--size;
+      }
+    --nwin;
+  }
+};
+
+/*
+  What has to change in the buffer to go from the previous window to
+  this one, which is the same for every permutation.
+*/
+struct esm_scanstep
+{
+  //fill the buffer from scratch, for the first window or when there is little overlap
+  bool rebuild;
+  //columns leaving the window, and columns entering it
+  size_t leave_first,leave_last,enter_first,enter_last;
+  //columns in both windows whose LD filter differs
+  vector<size_t> changed;
+};
+
+template<typename D>
+static void esm_scan( const D * data,
+		      const ESMBASE * table,
+		      const size_t & stride,
+		      const size_t & nperms,
+		      const vector< pair<size_t,size_t> > & windows,
+		      const vector< vector<short> > & keep,
+		      const vector< vector<ESMBASE> > & offsets,
+		      const vector<ESMBASE> & ESM_obs,
+		      vector<size_t> & nexceed )
+{
+  if( windows.empty() ) { return; }
+  vector<esm_scanstep> steps( windows.size() );
+  size_t K = 1;
+  for( size_t w = 0 ; w < windows.size() ; ++w )
+    {
+      K = max(K,offsets[w].size());
+      const size_t cf = windows[w].first, cl = windows[w].second;
+      esm_scanstep & S = steps[w];
+      S.rebuild = true;
+      if( w == 0 || cf > windows[w-1].second ) { continue; }
+      const size_t pf = windows[w-1].first, pl = windows[w-1].second;
+      S.leave_first = pf;
+      S.leave_last = cf;
+      S.enter_first = pl+1;
+      S.enter_last = cl+1;
+      for( size_t q = cf ; q <= pl ; ++q )
+	{
+	  if( keep[w-1][q-pf] != keep[w][q-cf] )
+	    {
+	      S.changed.push_back(q);
+	    }
+	}
+      //Only worth it if there are fewer updates than values in the window
+      S.rebuild = ( (cf-pf) + (cl-pl) + 2*S.changed.size() >= cl-cf+1 );
+    }
+
+  //Twice K leaves room for evictions before a refill is needed
+  esm_topbuffer T( 2*K );
+  for( size_t j = 0 ; j < nperms ; ++j )
+    {
+      const D * row = data + stride*j;
+      for( size_t w = 0 ; w < windows.size() ; ++w )
+	{
+	  const size_t cf = windows[w].first, cl = windows[w].second;
+	  const esm_scanstep & S = steps[w];
+	  if( !S.rebuild )
+	    {
+	      const size_t pf = windows[w-1].first;
+	      for( size_t q = S.leave_first ; q < S.leave_last ; ++q )
+		{
+		  T.remove(perm_value(row + q,table)*keep[w-1][q-pf]);
+		}
+	      for( size_t c = 0 ; c < S.changed.size() ; ++c )
+		{
+		  const size_t q = S.changed[c];
+		  const ESMBASE v = perm_value(row + q,table);
+		  T.remove(v*keep[w-1][q-pf]);
+		  T.insert(v*keep[w][q-cf]);
+		}
+	      for( size_t q = S.enter_first ; q < S.enter_last ; ++q )
+		{
+		  T.insert(perm_value(row + q,table)*keep[w][q-cf]);
+		}
+	    }
+	  if( S.rebuild || T.size < offsets[w].size() )
+	    {
+	      T.clear();
+	      for( size_t q = cf ; q <= cl ; ++q )
+		{
+		  T.insert(perm_value(row + q,table)*keep[w][q-cf]);
+		}
+	    }
+	  if( esm_sum(&T.buf[0],offsets[w]) >= ESM_obs[w] )
+	    {
+	      ++nexceed[w];
+	    }
+	}
+    }
+}
+
+void esm_scan_exceedances( const ESMBASE * data,
+			   const size_t & stride,
+			   const size_t & nperms,
+			   const vector< pair<size_t,size_t> > & windows,
+			   const vector< vector<short> > & keep,
+			   const vector< vector<ESMBASE> > & offsets,
+			   const vector<ESMBASE> & ESM_obs,
+			   vector<size_t> & nexceed )
+{
+  esm_scan(data,static_cast<const ESMBASE *>(nullptr),stride,nperms,windows,keep,offsets,ESM_obs,nexceed);
+}
+
+void esm_scan_exceedances( const uint16_t * data,
+			   const ESMBASE * table,
+			   const size_t & stride,
+			   const size_t & nperms,
+			   const vector< pair<size_t,size_t> > & windows,
+			   const vector< vector<short> > & keep,
+			   const vector< vector<ESMBASE> > & offsets,
+			   const vector<ESMBASE> & ESM_obs,
+			   vector<size_t> & nexceed )
+{
+  esm_scan(data,table,stride,nperms,windows,keep,offsets,ESM_obs,nexceed);
+}
+
+#ifdef ESM_X86_KERNELS
+/*
+  The vector kernels work on W permutations at once, one per lane.
+  For each marker, the W values for that marker are gathered from the
+  perm-major data into one vector, and each lane keeps its own top K
+  in top[i*W + lane], sorted in descending order.  Quantized perms are
+  loaded one by one (a 32-bit gather could read past the end of the
+  data) and their values gathered from the table.
+
+  A new value is pushed through the top K with a chain of max/min
+  operations.  Once the buffer is full, a marker is skipped unless
+  at least one lane beats its current Kth value, which is true for
+  most markers after the first few.
+
+  The AVX-512 gather, max and min are the masked forms with every
+  lane set, as the unmasked ones leave their unused source
+  uninitialized, which GCC 12 warns about (GCC bug 105593).
+
+  The sum is taken in the same order as esm_sum, lane by lane,
+  so these return the same counts as the scalar kernel.  They only
+  do whole blocks of W permutations; esm_exceedances_dispatch does
+  the ones left over with the scalar kernel.
+*/
+__attribute__((target("avx2"),unused))
+static inline __m256 gather8( const float * p,
+			      const __m256i & vindex,
+			      const size_t &,
+			      const float * )
+{
+  return _mm256_i32gather_ps(p,vindex,4);
+}
+
+__attribute__((target("avx2"),unused))
+static inline __m256 gather8( const uint16_t * p,
+			      const __m256i &,
+			      const size_t & stride,
+			      const float * table )
+{
+  const __m256i q = _mm256_setr_epi32(p[0],p[stride],p[2*stride],p[3*stride],
+				      p[4*stride],p[5*stride],p[6*stride],p[7*stride]);
+  return _mm256_i32gather_ps(table,q,4);
+}
+
+template<typename D>
+__attribute__((target("avx2")))
+static size_t esm_exceedances_avx2( const D * data,
+				    const float * table,
+				    const size_t & nperms,
+				    const int & nmarkers,
+				    const size_t & stride,
+				    const short * keep,
+				    const vector<float> & offsets,
+				    const float & ESM_obs )
+{
+  const size_t K = offsets.size();
+  if( K == 0 ) { return 0; }
+  const size_t W = 8;
+  vector<float> topbuf( K*W );
+  float * top = &topbuf[0];
+  const __m256i vindex = _mm256_mullo_epi32(_mm256_setr_epi32(0,1,2,3,4,5,6,7),
+					    _mm256_set1_epi32(int(stride)));
+  const __m256 obs = _mm256_set1_ps(ESM_obs);
+  size_t nexceed = 0;
+  for ( size_t j = 0 ; j + W <= nperms ; j += W )
+    {
+      const D * block = data + stride*j;
+      for ( int k = 0 ; k < nmarkers ; ++k )
+	{
+	  __m256 v = _mm256_mul_ps(gather8(block+k,vindex,stride,table),
+				   _mm256_set1_ps(keep[k]));
+	  size_t n = size_t(k);
+	  if( n >= K )
+	    {
+	      __m256 last = _mm256_loadu_ps(top+(K-1)*W);
+	      if( !_mm256_movemask_ps(_mm256_cmp_ps(v,last,_CMP_GT_OQ)) )
+		{
+		  continue;
+		}
+	      n = K;
+	    }
+	  for ( size_t i = 0 ; i < n ; ++i )
+	    {
+	      __m256 t = _mm256_loadu_ps(top+i*W);
+	      _mm256_storeu_ps(top+i*W,_mm256_max_ps(t,v));
+	      v = _mm256_min_ps(t,v);
+	    }
+	  //still filling the buffer, else v is the value that drops out
+	  if( n < K )
+	    {
+	      _mm256_storeu_ps(top+n*W,v);
+	    }
+	}
+      __m256 ESM = _mm256_setzero_ps();
+      for ( size_t k = 0 ; k < K ; ++k )
+	{
+	  ESM = _mm256_add_ps(ESM,_mm256_add_ps(_mm256_loadu_ps(top+k*W),
+						_mm256_set1_ps(offsets[k])));
+	}
+      nexceed += __builtin_popcount(_mm256_movemask_ps(_mm256_cmp_ps(ESM,obs,_CMP_GE_OQ)));
+    }
+  return nexceed;
+}
+
+#ifdef ESM_AVX512_KERNEL
+__attribute__((target("avx512f"),unused))
+static inline __m512 gather16( const float * p,
+			       const __m512i & vindex,
+			       const size_t &,
+			       const float * )
+{
+  return _mm512_mask_i32gather_ps(_mm512_setzero_ps(),0xFFFF,vindex,p,4);
+}
+
+__attribute__((target("avx512f"),unused))
+static inline __m512 gather16( const uint16_t * p,
+			       const __m512i &,
+			       const size_t & stride,
+			       const float * table )
+{
+  const __m512i q = _mm512_setr_epi32(p[0],p[stride],p[2*stride],p[3*stride],
+				      p[4*stride],p[5*stride],p[6*stride],p[7*stride],
+				      p[8*stride],p[9*stride],p[10*stride],p[11*stride],
+				      p[12*stride],p[13*stride],p[14*stride],p[15*stride]);
+  return _mm512_mask_i32gather_ps(_mm512_setzero_ps(),0xFFFF,q,table,4);
+}
+
+template<typename D>
+__attribute__((target("avx512f")))
+static size_t esm_exceedances_avx512( const D * data,
+				      const float * table,
+				      const size_t & nperms,
+				      const int & nmarkers,
+				      const size_t & stride,
+				      const short * keep,
+				      const vector<float> & offsets,
+				      const float & ESM_obs )
+{
+  const size_t K = offsets.size();
+  if( K == 0 ) { return 0; }
+  const size_t W = 16;
+  vector<float> topbuf( K*W );
+  float * top = &topbuf[0];
+  const __m512i vindex = _mm512_mullo_epi32(_mm512_setr_epi32(0,1,2,3,4,5,6,7,
+							      8,9,10,11,12,13,14,15),
+					    _mm512_set1_epi32(int(stride)));
+  const __m512 obs = _mm512_set1_ps(ESM_obs);
+  size_t nexceed = 0;
+  for ( size_t j = 0 ; j + W <= nperms ; j += W )
+    {
+      const D * block = data + stride*j;
+      for ( int k = 0 ; k < nmarkers ; ++k )
+	{
+	  __m512 v = _mm512_mul_ps(gather16(block+k,vindex,stride,table),
+				   _mm512_set1_ps(keep[k]));
+	  size_t n = size_t(k);
+	  if( n >= K )
+	    {
+	      __m512 last = _mm512_loadu_ps(top+(K-1)*W);
+	      if( !_mm512_cmp_ps_mask(v,last,_CMP_GT_OQ) )
+		{
+		  continue;
+		}
+	      n = K;
+	    }
+	  for ( size_t i = 0 ; i < n ; ++i )
+	    {
+	      __m512 t = _mm512_loadu_ps(top+i*W);
+	      _mm512_storeu_ps(top+i*W,_mm512_mask_max_ps(t,0xFFFF,t,v));
+	      v = _mm512_mask_min_ps(v,0xFFFF,t,v);
+	    }
+	  if( n < K )
+	    {
+	      _mm512_storeu_ps(top+n*W,v);
+	    }
+	}
+      __m512 ESM = _mm512_setzero_ps();
+      for ( size_t k = 0 ; k < K ; ++k )
+	{
+	  ESM = _mm512_add_ps(ESM,_mm512_add_ps(_mm512_loadu_ps(top+k*W),
+						_mm512_set1_ps(offsets[k])));
+	}
+      nexceed += __builtin_popcount(_mm512_cmp_ps_mask(ESM,obs,_CMP_GE_OQ));
+    }
+  return nexceed;
+}
+#endif
+#endif
+
+//The implementations of esm_exceedances
+enum esm_kernel_id { KERNEL_SCALAR, KERNEL_AVX2, KERNEL_AVX512 };
+
+static const char * kernel_names[] = { "scalar", "avx2", "avx512" };
+
+//The widest kernel the CPU supports
+static esm_kernel_id best_kernel( void )
+{
+#ifdef ESM_X86_KERNELS
+  //the vector kernels are written for single precision only
+  if( is_same<ESMBASE,float>::value )
+    {
+      __builtin_cpu_init();
+#ifdef ESM_AVX512_KERNEL
+      if( __builtin_cpu_supports("avx512f") ) { return KERNEL_AVX512; }
+#endif
+      if( __builtin_cpu_supports("avx2") ) { return KERNEL_AVX2; }
+    }
+#endif
+  return KERNEL_SCALAR;
+}
+
+//The kernel in use, resolved once here or by set_esm_kernel
+static esm_kernel_id kernel = best_kernel();
+
+bool set_esm_kernel( const string & name )
+{
+  const esm_kernel_id best = best_kernel();
+  if( name == "auto" )
+    {
+      kernel = best;
+      return true;
+    }
+  for( int k = KERNEL_SCALAR ; k <= best ; ++k )
+    {
+      //a CPU with AVX-512 also has AVX2
+      if( name == kernel_names[k] )
+	{
+	  kernel = esm_kernel_id(k);
+	  return true;
+	}
+    }
+  return false;
+}
+
+string esm_kernel( void )
+{
+  return kernel_names[kernel];
+}
+
+/*
+  With ESMBASE = float, the vector kernels can be used.  These are
+  templates so that only the one for ESMBASE is ever compiled.
+*/
+template<typename D, typename T>
+static size_t esm_exceedances_dispatch( const D * data,
+					const T * table,
+					const size_t & nperms,
+					const int & nmarkers,
+					const size_t & stride,
+					const short * keep,
+					const vector<T> & offsets,
+					const T & ESM_obs,
+					true_type )
+{
+  size_t nexceed = 0, done = 0;
+#ifdef ESM_X86_KERNELS
+  //the gathers index a block of permutations with 32-bit offsets
+  if( stride <= size_t(numeric_limits<int>::max()/16) )
+    {
+      if( kernel == KERNEL_AVX2 )
+	{
+	  done = nperms - nperms % 8;
+	  nexceed = esm_exceedances_avx2(data,table,done,nmarkers,stride,keep,offsets,ESM_obs);
+	}
+#ifdef ESM_AVX512_KERNEL
+      if( kernel == KERNEL_AVX512 )
+	{
+	  done = nperms - nperms % 16;
+	  nexceed = esm_exceedances_avx512(data,table,done,nmarkers,stride,keep,offsets,ESM_obs);
+	}
+#endif
+    }
+#endif
+  return nexceed + esm_exceedances_scalar(data + stride*done,table,nperms - done,
+					  nmarkers,stride,keep,offsets,ESM_obs);
+}
+
+//Otherwise only the scalar kernel can
+template<typename D, typename T>
+static size_t esm_exceedances_dispatch( const D * data,
+					const T * table,
+					const size_t & nperms,
+					const int & nmarkers,
+					const size_t & stride,
+					const short * keep,
+					const vector<T> & offsets,
+					const T & ESM_obs,
+					false_type )
+{
+  return esm_exceedances_scalar(data,table,nperms,nmarkers,stride,keep,offsets,ESM_obs);
+}
+
+size_t esm_exceedances( const ESMBASE * data,
+			const size_t & nperms,
+			const int & nmarkers,
+			const size_t & stride,
+			const short * keep,
+			const vector<ESMBASE> & offsets,
+			const ESMBASE & ESM_obs )
+{
+  return esm_exceedances_dispatch(data,static_cast<const ESMBASE *>(nullptr),nperms,nmarkers,stride,keep,offsets,ESM_obs,
+				  integral_constant<bool,is_same<ESMBASE,float>::value>());
+}
+
+size_t esm_exceedances( const uint16_t * data,
+			const ESMBASE * table,
+			const size_t & nperms,
+			const int & nmarkers,
+			const size_t & stride,
+			const short * keep,
+			const vector<ESMBASE> & offsets,
+			const ESMBASE & ESM_obs )
+{
+  return esm_exceedances_dispatch(data,table,nperms,nmarkers,stride,keep,offsets,ESM_obs,
+				  integral_constant<bool,is_same<ESMBASE,float>::value>());
+}
@@ -0,0 +1,126 @@
+#ifndef __ESMkernel_HPP__
+#define __ESMkernel_HPP__
+
+#include <vector>
+#include <string>
+#include <utility>
+#include <cstddef>
+#include <cstdint>
+#include <ESMH5type.hpp>
+
+/*
+  The ESM_K statistic for a window of M markers is
+
+  ESM = SUM_k_K(Y_k + log10(k/M))
+
+  where Y_k is the kth most significant value in the window.
+
+  The log10(k/M) terms only depend on the window, so they
+  are computed once per window by esm_offsets and then reused
+  for every permutation.  The return value has min(K,M) elements.
+*/
+std::vector<ESMBASE> esm_offsets( const int & nmarkers,
+				  const int & K );
+
+/*
+  Sums the top values in top (sorted in descending order) plus
+  the offsets from esm_offsets, in the same order as the
+  original full-sort implementation so that results are
+  bit-identical.
+*/
+ESMBASE esm_sum( const ESMBASE * top,
+		 const std::vector<ESMBASE> & offsets );
+
+/*
+  Returns the number of permutations whose ESM_K statistic
+  is >= ESM_obs.
+
+  data is perm-major with stride values per permutation: the value
+  for marker k in permutation j is data[stride*j + k], so a window
+  can be passed as a view into a wider slab, with data pointing at
+  its first marker.  Markers with keep[k] == 0 contribute a value
+  of zero.
+
+  Only the top min(K,M) values are selected for each permutation,
+  using a running insertion into a buffer that is allocated once per
+  call, rather than sorting all M values.
+
+  On x86-64 this dispatches to an AVX2 or AVX-512 kernel that does
+  8 or 16 permutations at once (see set_esm_kernel).  All kernels
+  return identical counts.
+*/
+std::size_t esm_exceedances( const ESMBASE * data,
+			     const std::size_t & nperms,
+			     const int & nmarkers,
+			     const std::size_t & stride,
+			     const short * keep,
+			     const std::vector<ESMBASE> & offsets,
+			     const ESMBASE & ESM_obs );
+
+/*
+  The same, for quantized perms (perms2h5 --quantize): data holds the
+  16-bit integers q as they are stored, and the value of q is
+  table[q], so table has 65536 entries.  The values are looked up as
+  the kernels go, so the counts are those esm_exceedances gives for
+  the looked-up values, while the data take half the memory.
+*/
+std::size_t esm_exceedances( const std::uint16_t * data,
+			     const ESMBASE * table,
+			     const std::size_t & nperms,
+			     const int & nmarkers,
+			     const std::size_t & stride,
+			     const short * keep,
+			     const std::vector<ESMBASE> & offsets,
+			     const ESMBASE & ESM_obs );
+
+/*
+  Incremental version of esm_exceedances for a run of overlapping windows.
+
+  data is a perm-major slab of nperms permutations, with stride values
+  per permutation.  Window w covers slab columns windows[w].first to
+  windows[w].second (inclusive), and keep[w], offsets[w] and ESM_obs[w]
+  are as for esm_exceedances.  Windows must be in left-to-right order.
+
+  For each permutation, a buffer of the largest values in the window
+  is carried from one window to the next.  Values of markers that leave
+  the window (or whose LD filter changes) are evicted, and those that
+  enter are inserted, so the cost per window scales with the jump size
+  rather than the window size.  The buffer is only refilled from the
+  slab when evictions leave fewer than K values in it.  The resulting
+  counts are identical to esm_exceedances.
+
+  The count for window w is added to nexceed[w].
+*/
+void esm_scan_exceedances( const ESMBASE * data,
+			   const std::size_t & stride,
+			   const std::size_t & nperms,
+			   const std::vector< std::pair<std::size_t,std::size_t> > & windows,
+			   const std::vector< std::vector<short> > & keep,
+			   const std::vector< std::vector<ESMBASE> > & offsets,
+			   const std::vector<ESMBASE> & ESM_obs,
+			   std::vector<std::size_t> & nexceed );
+
+//The same, for quantized perms looked up in table, as for esm_exceedances
+void esm_scan_exceedances( const std::uint16_t * data,
+			   const ESMBASE * table,
+			   const std::size_t & stride,
+			   const std::size_t & nperms,
+			   const std::vector< std::pair<std::size_t,std::size_t> > & windows,
+			   const std::vector< std::vector<short> > & keep,
+			   const std::vector< std::vector<ESMBASE> > & offsets,
+			   const std::vector<ESMBASE> & ESM_obs,
+			   std::vector<std::size_t> & nexceed );
+
+/*
+  Chooses the implementation used by esm_exceedances.
+  name is one of "auto", "scalar", "avx2" or "avx512".
+  "auto" picks the widest one the CPU supports.
+  Returns false if name is unknown or not supported on this CPU.
+  Call this before starting any threads.
+*/
+bool set_esm_kernel( const std::string & name );
+
+//The name of the implementation currently in use
+std::string esm_kernel( void );
+
+#endif
@@ -0,0 +1,258 @@
+#include <H5filters.hpp>
+#include <zlib.h>
+#include <cstring>
+#include <cstdint>
+#include <mutex>
+#include <algorithm>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+using namespace std;
+
+namespace
+{
+#ifdef HAVE_LZ4
+  //The LZ4 filter's header and block sizes are big-endian
+  void put_be( vector<char> & out, const uint64_t & x, const int & nbytes )
+  {
+    for( int i = nbytes - 1 ; i >= 0 ; --i )
+      {
+	out.push_back( char((x >> (8*i)) & 0xff) );
+      }
+  }
+
+  uint64_t get_be( const char * in, const int & nbytes )
+  {
+    uint64_t x = 0;
+    for( int i = 0 ; i < nbytes ; ++i )
+      {
+	x = (x << 8) | uint64_t(static_cast<unsigned char>(in[i]));
+      }
+    return x;
+  }
+
+  vector<char> lz4_encode( const char * in, const size_t & nbytes, size_t block )
+  {
+    block = min( max(block,size_t(1)), max(nbytes,size_t(1)) );
+    vector<char> out;
+    out.reserve( 12 + nbytes + nbytes/100 + 64 );
+    put_be( out, nbytes, 8 );
+    put_be( out, block, 4 );
+    vector<char> z;
+    for( size_t done = 0 ; done < nbytes ; done += block )
+      {
+	const int n = int(min(block,nbytes - done));
+	z.resize( LZ4_compressBound(n) );
+	const int c = LZ4_compress_default( in + done, z.data(), n, int(z.size()) );
+	//a block that does not get smaller is stored as it is
+	if( c <= 0 || c >= n )
+	  {
+	    put_be( out, uint64_t(n), 4 );
+	    out.insert( out.end(), in + done, in + done + n );
+	  }
+	else
+	  {
+	    put_be( out, uint64_t(c), 4 );
+	    out.insert( out.end(), z.begin(), z.begin() + c );
+	  }
+      }
+    return out;
+  }
+
+  bool lz4_decode( const char * in, const size_t & nbytes, vector<char> & out )
+  {
+    if( nbytes < 12 ) { return false; }
+    const uint64_t size = get_be( in, 8 ), block = get_be( in + 8, 4 );
+    if( size > 0 && block == 0 ) { return false; }
+    out.resize( size );
+    size_t pos = 12;
+    for( uint64_t done = 0 ; done < size ; done += block )
+      {
+	const uint64_t n = min(block,size - done);
+	if( pos + 4 > nbytes ) { return false; }
+	const uint64_t c = get_be( in + pos, 4 );
+	pos += 4;
+	if( c > nbytes - pos ) { return false; }
+	if( c == n )
+	  {
+	    memcpy( &out[done], in + pos, n );
+	  }
+	else if( LZ4_decompress_safe( in + pos, &out[done], int(c), int(n) ) != int(n) )
+	  {
+	    return false;
+	  }
+	pos += c;
+      }
+    return true;
+  }
+#endif
+
+#ifdef HAVE_ZSTD
+  bool zstd_decode( const char * in, const size_t & nbytes, vector<char> & out )
+  {
+    const unsigned long long size = ZSTD_getFrameContentSize( in, nbytes );
+    if( size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR ) { return false; }
+    out.resize( size );
+    const size_t n = ZSTD_decompress( out.data(), out.size(), in, nbytes );
+    return !ZSTD_isError(n) && n == size;
+  }
+#endif
+
+#if defined(HAVE_LZ4) || defined(HAVE_ZSTD)
+  /*
+    Hands a filter's output back to HDF5 in place of its input.  Filters
+    must use HDF5's allocator for the buffers they swap.
+  */
+  size_t replace_buffer( const vector<char> & out, size_t * buf_size, void ** buf )
+  {
+    void * p = H5allocate_memory( max(out.size(),size_t(1)), false );
+    if( p == NULL ) { return 0; }
+    if( !out.empty() )
+      {
+	memcpy( p, out.data(), out.size() );
+      }
+    H5free_memory( *buf );
+    *buf = p;
+    *buf_size = max(out.size(),size_t(1));
+    return out.size();
+  }
+#endif
+
+#ifdef HAVE_LZ4
+  size_t lz4_filter( unsigned int flags, size_t cd_nelmts, const unsigned int cd_values[],
+		     size_t nbytes, size_t * buf_size, void ** buf )
+  {
+    const char * in = static_cast<const char *>(*buf);
+    vector<char> out;
+    if( flags & H5Z_FLAG_REVERSE )
+      {
+	if( !lz4_decode(in,nbytes,out) ) { return 0; }
+      }
+    else
+      {
+	out = lz4_encode( in, nbytes, (cd_nelmts > 0 && cd_values[0] > 0) ? cd_values[0] : nbytes );
+      }
+    return replace_buffer( out, buf_size, buf );
+  }
+
+  const H5Z_class2_t lz4_class = { H5Z_CLASS_T_VERS, FILTER_LZ4, 1, 1, "lz4", NULL, NULL, lz4_filter };
+#endif
+
+#ifdef HAVE_ZSTD
+  size_t zstd_filter( unsigned int flags, size_t cd_nelmts, const unsigned int cd_values[],
+		      size_t nbytes, size_t * buf_size, void ** buf )
+  {
+    const char * in = static_cast<const char *>(*buf);
+    vector<char> out;
+    if( flags & H5Z_FLAG_REVERSE )
+      {
+	if( !zstd_decode(in,nbytes,out) ) { return 0; }
+      }
+    else
+      {
+	out = encode_chunk( FILTER_ZSTD, (cd_nelmts > 0) ? int(cd_values[0]) : 0, in, nbytes );
+	if( out.empty() ) { return 0; }
+      }
+    return replace_buffer( out, buf_size, buf );
+  }
+
+  const H5Z_class2_t zstd_class = { H5Z_CLASS_T_VERS, FILTER_ZSTD, 1, 1, "zstd", NULL, NULL, zstd_filter };
+#endif
+
+  once_flag registered;
+}
+
+void register_filters( void )
+{
+  call_once( registered, []() {
+#ifdef HAVE_LZ4
+      H5Zregister( &lz4_class );
+#endif
+#ifdef HAVE_ZSTD
+      H5Zregister( &zstd_class );
+#endif
+    } );
+}
+
+bool have_filter( const H5Z_filter_t & f )
+{
+#ifdef HAVE_LZ4
+  if( f == FILTER_LZ4 ) { return true; }
+#endif
+#ifdef HAVE_ZSTD
+  if( f == FILTER_ZSTD ) { return true; }
+#endif
+  return f == H5Z_FILTER_DEFLATE;
+}
+
+H5Z_filter_t codec_filter( const string & name )
+{
+  H5Z_filter_t f = H5Z_FILTER_NONE;
+  if( name == "deflate" ) { f = H5Z_FILTER_DEFLATE; }
+  else if( name == "lz4" ) { f = FILTER_LZ4; }
+  else if( name == "zstd" ) { f = FILTER_ZSTD; }
+  return have_filter(f) ? f : H5Z_FILTER_NONE;
+}
+
+vector<char> encode_chunk( const H5Z_filter_t & f,
+			   const int & level,
+			   const char * in,
+			   const size_t & nbytes )
+{
+  vector<char> out;
+#ifdef HAVE_LZ4
+  if( f == FILTER_LZ4 )
+    {
+      return lz4_encode( in, nbytes, nbytes );
+    }
+#endif
+#ifdef HAVE_ZSTD
+  if( f == FILTER_ZSTD )
+    {
+      out.resize( ZSTD_compressBound(nbytes) );
+      const size_t n = ZSTD_compress( out.data(), out.size(), in, nbytes, level );
+      out.resize( ZSTD_isError(n) ? 0 : n );
+      return out;
+    }
+#endif
+  if( f == H5Z_FILTER_DEFLATE )
+    {
+      uLongf zbytes = compressBound(nbytes);
+      out.resize(zbytes);
+      const int rc = compress2(reinterpret_cast<Bytef *>(out.data()),&zbytes,reinterpret_cast<const Bytef *>(in),nbytes,level);
+      out.resize( (rc == Z_OK) ? zbytes : 0 );
+    }
+  return out;
+}
+
+bool decode_chunk( const H5Z_filter_t & f,
+		   const vector<char> & in,
+		   vector<char> & out,
+		   const size_t & nbytes )
+{
+#ifdef HAVE_LZ4
+  if( f == FILTER_LZ4 )
+    {
+      return lz4_decode( in.data(), in.size(), out ) && out.size() == nbytes;
+    }
+#endif
+#ifdef HAVE_ZSTD
+  if( f == FILTER_ZSTD )
+    {
+      return zstd_decode( in.data(), in.size(), out ) && out.size() == nbytes;
+    }
+#endif
+  if( f == H5Z_FILTER_DEFLATE )
+    {
+      out.resize(nbytes);
+      uLongf len = nbytes;
+      return uncompress(reinterpret_cast<Bytef *>(out.data()),&len,
+			reinterpret_cast<const Bytef *>(in.data()),in.size()) == Z_OK && len == nbytes;
+    }
+  return false;
+}
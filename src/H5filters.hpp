@@ -0,0 +1,65 @@
+#ifndef __H5filters_HPP__
+#define __H5filters_HPP__
+
+#include <H5Cpp.h>
+#include <vector>
+#include <string>
+#include <cstddef>
+
+/*
+  Compression filters for the permutation datasets that are faster
+  than deflate: LZ4 (HAVE_LZ4) and Zstandard (HAVE_ZSTD).  They are
+  compiled into the programs and registered with HDF5 by
+  register_filters, so they do not depend on HDF5 plugins being
+  installed.  They use the ids registered with The HDF Group for
+  these codecs, and lay out their chunks the same way as the
+  registered filters, so the files can also be read by HDF5 tools
+  with those plugins:
+
+  LZ4 (32004): the original size (8 bytes) and block size (4 bytes),
+  big-endian, then each block as its compressed size (4 bytes) and
+  data, or as it is if it does not get smaller.  cd_values[0], if
+  given, is the block size; the default is the whole chunk.
+
+  Zstandard (32015): one zstd frame.  cd_values[0], if given, is the
+  level.
+
+  perms2h5 puts HDF5's shuffle filter in front of either, as it does
+  for deflate.
+*/
+const H5Z_filter_t FILTER_LZ4 = 32004;
+const H5Z_filter_t FILTER_ZSTD = 32015;
+
+//Registers the filters that were compiled in with HDF5.  Safe to call more than once, but not concurrently with other HDF5 calls.
+void register_filters( void );
+
+//true if encode_chunk and decode_chunk can do filter f, which deflate always can
+bool have_filter( const H5Z_filter_t & f );
+
+/*
+  The filter for a --codec name ("deflate", "lz4" or "zstd"), or
+  H5Z_FILTER_NONE if it is unknown or was not compiled in.
+*/
+H5Z_filter_t codec_filter( const std::string & name );
+
+/*
+  Compresses the nbytes at in with filter f (deflate, LZ4 or
+  Zstandard) at level, which is ignored by LZ4, as the HDF5 filter
+  would.  Returns an empty vector if the compressor fails or f is
+  not one of them.
+*/
+std::vector<char> encode_chunk( const H5Z_filter_t & f,
+				const int & level,
+				const char * in,
+				const std::size_t & nbytes );
+
+/*
+  Undoes filter f on in, into out.  Returns false if the data are
+  corrupt or do not come out to nbytes.
+*/
+bool decode_chunk( const H5Z_filter_t & f,
+		   const std::vector<char> & in,
+		   std::vector<char> & out,
+		   const std::size_t & nbytes );
+
+#endif
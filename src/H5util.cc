@@ -1,6 +1,13 @@
 #include <H5util.hpp>
+#include <H5filters.hpp>
 #include <ESMH5type.hpp>
 #include <cstdlib>
+#include <stdexcept>
+#include <algorithm>
+#include <mutex>
+#include <cstring>
+#include <fstream>
+#include <type_traits>
 
 using namespace std;
 using namespace H5;
@@ -16,12 +23,50 @@ vector< string > read_strings( const char * filename, const char * dsetname )
   hsize_t dims[1] = {MAXSTRINGSIZE};
   hid_t space = H5Dget_space (dset);
   int ndims = H5Sget_simple_extent_dims (space, dims, NULL);
+
+  //fixed-length strings, as column_writer writes them
+  if( H5Tis_variable_str(filetype) <= 0 )
+    {
+      size_t width = H5Tget_size(filetype);
+      hid_t memtype = H5Tcopy (H5T_C_S1);
+      H5Tset_size (memtype, width);
+      H5Tset_strpad (memtype, H5T_STR_NULLPAD);
+      vector<char> fdata(dims[0]*width + 1,'\0');
+      herr_t status = H5Dread (dset, memtype, H5S_ALL, H5S_ALL, H5P_DEFAULT, fdata.data());
+      H5Dclose(dset);
+      H5Sclose(space);
+      H5Tclose(filetype);
+      H5Tclose(memtype);
+      H5Fclose(file);
+      if( status < 0 )
+	{
+	  throw runtime_error( string("could not read ") + dsetname + " in " + filename );
+	}
+      vector<string> rv;
+      for (hsize_t i=0; i<dims[0]; i++)
+	{
+	  const char * s = &fdata[i*width];
+	  rv.push_back( string(s, find(s, s + width, '\0')) );
+	}
+      return rv;
+    }
+
   char **rdata = (char **) malloc (dims[0] * sizeof (char *));  
     
   hid_t memtype = H5Tcopy (H5T_C_S1);
   herr_t status = H5Tset_size (memtype, H5T_VARIABLE);
 
   status = H5Dread (dset, memtype, H5S_ALL, H5S_ALL, H5P_DEFAULT, rdata);
+  if( status < 0 )
+    {
+      free(rdata);
+      H5Dclose(dset);
+      H5Sclose(space);
+      H5Tclose(filetype);
+      H5Tclose(memtype);
+      H5Fclose(file);
+      throw runtime_error( string("could not read ") + dsetname + " in " + filename );
+    }
 
   vector<string> rv;
   for (unsigned i=0; i<dims[0]; i++)
@@ -87,6 +132,493 @@ vector<ESMBASE> read_doubles( const char * filename, const char * dsetname )
   return receiver;
 }
 
+//The HDF5 memory type matching ESMBASE
+static hid_t esmbase_memtype( void )
+{
+  return (sizeof(ESMBASE) == sizeof(double)) ? H5T_NATIVE_DOUBLE : H5T_NATIVE_FLOAT;
+}
+
+/*
+  The HDF5 library is not thread-safe, so every perm_reader
+  serializes its calls into it on this lock.
+*/
+static mutex hdf5_lock;
+
+perm_reader::perm_reader( const char * filename,
+			  const char * dsetname,
+			  const size_t & cmarkers,
+			  const size_t & cperms ) : file(-1),
+						    dset(-1),
+						    fspace(-1),
+						    fname(filename),
+						    T(false),
+						    np(0),
+						    nm(0),
+						    direct(false),
+						    quant(false),
+						    qscale(1.),
+						    qoffset(0.),
+						    band(0)
+{
+  lock_guard<mutex> lock(hdf5_lock);
+  register_filters();
+  file = H5Fopen( filename, H5F_ACC_RDONLY, H5P_DEFAULT );
+  if( file < 0 )
+    {
+      throw runtime_error( string("could not open ") + filename );
+    }
+  string dsetname_T = string(dsetname) + "_T";
+  T = ( H5Lexists(file,dsetname_T.c_str(),H5P_DEFAULT) > 0 );
+  const char * name = T ? dsetname_T.c_str() : dsetname;
+
+  //Find the chunk dimensions, falling back to cmarkers and cperms
+  cdims[0] = T ? cmarkers : cperms;
+  cdims[1] = T ? cperms : cmarkers;
+  hid_t probe = H5Dopen2( file, name, H5P_DEFAULT );
+  if( probe < 0 )
+    {
+      H5Fclose(file);
+      throw runtime_error( string("could not open ") + name + " in " + filename );
+    }
+  //quantized perms are 16-bit integers with a scale
+  hid_t ftype = H5Dget_type( probe );
+  quant = ( H5Tget_class(ftype) == H5T_INTEGER && H5Aexists(probe,"scale") > 0 );
+  if( quant )
+    {
+      hid_t attr = H5Aopen( probe, "scale", H5P_DEFAULT );
+      H5Aread( attr, H5T_NATIVE_DOUBLE, &qscale );
+      H5Aclose(attr);
+      if( H5Aexists(probe,"offset") > 0 )
+	{
+	  attr = H5Aopen( probe, "offset", H5P_DEFAULT );
+	  H5Aread( attr, H5T_NATIVE_DOUBLE, &qoffset );
+	  H5Aclose(attr);
+	}
+    }
+  hid_t dcpl = H5Dget_create_plist( probe );
+  if( H5Pget_layout(dcpl) == H5D_CHUNKED )
+    {
+      H5Pget_chunk( dcpl, 2, cdims );
+      //the chunks can be decompressed here if they only went through filters that H5filters can undo
+      direct = ( H5Tequal(ftype,quant ? H5T_NATIVE_UINT16 : esmbase_memtype()) > 0 );
+      const int nfilters = H5Pget_nfilters( dcpl );
+      for( int i = 0 ; i < nfilters ; ++i )
+	{
+	  unsigned flags;
+	  size_t nelmts = 0;
+	  H5Z_filter_t f = H5Pget_filter2( dcpl, unsigned(i), &flags, &nelmts, NULL, 0, NULL, NULL );
+	  direct = direct && ( f == H5Z_FILTER_SHUFFLE || have_filter(f) );
+	  filters.push_back(f);
+	}
+    }
+  H5Pclose(dcpl);
+  H5Tclose(ftype);
+  //say so up front if the perms are compressed with a codec (e.g. lz4) that is neither built in nor a plugin
+  for( size_t i = 0 ; i < filters.size() ; ++i )
+    {
+      if( H5Zfilter_avail(filters[i]) <= 0 )
+	{
+	  H5Dclose(probe);
+	  H5Fclose(file);
+	  throw runtime_error( string(filename) + ": the permutations are compressed with HDF5 filter "
+			       + to_string(filters[i]) + ", which this program was built without" );
+	}
+    }
+  hid_t space = H5Dget_space( probe );
+  hsize_t dims[2];
+  H5Sget_simple_extent_dims( space, dims, NULL );
+  H5Sclose(space);
+  H5Dclose(probe);
+  np = T ? dims[1] : dims[0];
+  nm = T ? dims[0] : dims[1];
+
+  /*
+    When HDF5 decompresses the chunks, size the chunk cache of this
+    dataset.  Reads move left to right along the markers, so the cache
+    holds two columns of chunks, which is enough that a chunk straddling
+    two reads is only decompressed once.
+  */
+  hid_t dapl = H5Pcreate( H5P_DATASET_ACCESS );
+  if( !direct )
+    {
+      const size_t cp = T ? cdims[1] : cdims[0];
+      size_t nchunks = 2*(np/max(cp,size_t(1)) + 1);
+      size_t ccache = nchunks*cdims[0]*cdims[1]*H5Tget_size(esmbase_memtype());
+      size_t rdcc = 10*nchunks;
+      firstprime(rdcc);
+      H5Pset_chunk_cache( dapl, rdcc, ccache, 1. );
+    }
+  dset = H5Dopen2( file, name, dapl );
+  H5Pclose(dapl);
+  fspace = H5Dget_space( dset );
+}
+
+perm_reader::~perm_reader()
+{
+  lock_guard<mutex> lock(hdf5_lock);
+  if( fspace >= 0 ) H5Sclose(fspace);
+  if( dset >= 0 ) H5Dclose(dset);
+  if( file >= 0 ) H5Fclose(file);
+}
+
+size_t perm_reader::nperms( void ) const
+{
+  return np;
+}
+
+size_t perm_reader::nmarkers( void ) const
+{
+  return nm;
+}
+
+bool perm_reader::transposed( void ) const
+{
+  return T;
+}
+
+bool perm_reader::quantized( void ) const
+{
+  return quant;
+}
+
+vector<ESMBASE> perm_reader::dequantization_table( void ) const
+{
+  vector<ESMBASE> table( quant ? 65536 : 0 );
+  for( size_t q = 0 ; q < table.size() ; ++q )
+    {
+      table[q] = ESMBASE(qoffset + qscale*q);
+    }
+  return table;
+}
+
+/*
+  Copies n values from from, as they are stored in the file, into to,
+  turning quantized values into -log10 p values.
+*/
+void perm_reader::store( const char * from,
+			 const size_t & n,
+			 ESMBASE * to ) const
+{
+  if( !quant )
+    {
+      memcpy( to, from, n*sizeof(ESMBASE) );
+      return;
+    }
+  const uint16_t * q = reinterpret_cast<const uint16_t *>(from);
+  for( size_t v = 0 ; v < n ; ++v )
+    {
+      to[v] = ESMBASE(qoffset + qscale*q[v]);
+    }
+}
+
+//The same, for quantized values kept as they are
+void perm_reader::store( const char * from,
+			 const size_t & n,
+			 uint16_t * to ) const
+{
+  memcpy( to, from, n*sizeof(uint16_t) );
+}
+
+/*
+  Reads markers start ... start+len-1 for all perms, in whatever
+  order the file has them, into buffer laid out as described by
+  the rank 2 memspace.
+*/
+template<typename V>
+void perm_reader::read( const size_t & start,
+			const size_t & len,
+			const size_t & firstperm,
+			const size_t & nperms,
+			V * buffer,
+			const size_t & stride )
+{
+  //*Define the hyperslab in the dataset; see readdata.cpp in 
+  // the HDF5 group c++ API
+  hsize_t offset[2] = { T ? start : firstperm, T ? firstperm : start };
+  hsize_t count[2] = { T ? len : nperms, T ? nperms : len };
+  if( direct )
+    {
+      read_direct( offset, count, buffer, max(hsize_t(stride),count[1]) );
+      return;
+    }
+  //the memory is laid out like the file, but rows may be stride apart
+  hsize_t dimsm[2] = { count[0], max(hsize_t(stride),count[1]) };
+  hsize_t offset_out[2] = { 0, 0 };
+  //quantized perms are read as they are stored, and turned into ESMBASE after if need be
+  const bool convert = quant && !is_same<V,uint16_t>::value;
+  if( convert )
+    {
+      qscratch.resize( dimsm[0]*dimsm[1] );
+    }
+  {
+    lock_guard<mutex> lock(hdf5_lock);
+    hid_t memspace = H5Screate_simple( 2, dimsm, NULL );
+    H5Sselect_hyperslab( memspace, H5S_SELECT_SET, offset_out, NULL, count, NULL );
+    H5Sselect_hyperslab( fspace, H5S_SELECT_SET, offset, NULL, count, NULL );
+    herr_t status = H5Dread( dset, quant ? H5T_NATIVE_UINT16 : esmbase_memtype(), memspace, fspace, H5P_DEFAULT,
+			     convert ? static_cast<void *>(qscratch.data()) : static_cast<void *>(buffer) );
+    H5Sclose(memspace);
+    if( status < 0 )
+      {
+	throw runtime_error( fname + ": error reading permutations" );
+      }
+  }
+  //only the selected values, as the rows of buffer may have other files' perms between them
+  for( hsize_t r = 0 ; convert && r < count[0] ; ++r )
+    {
+      store( reinterpret_cast<const char *>(&qscratch[r*dimsm[1]]), count[1], buffer + r*dimsm[1] );
+    }
+}
+
+/*
+  Reads the count[0] x count[1] block at offset in the file into
+  buffer, with rows ld apart, one band of chunks at a time.  A band's
+  raw chunks are read under the lock, and then decompressed and copied
+  out without it.  Only the last band is kept, decompressed, as a
+  chunk straddling two reads is in the last band of the first one;
+  the raw chunks are freed as soon as they are decompressed.
+*/
+template<typename V>
+void perm_reader::read_direct( const hsize_t * offset,
+			       const hsize_t * count,
+			       V * buffer,
+			       const size_t & ld )
+{
+  //d is the dimension along the markers, and e along the perms
+  const int d = T ? 0 : 1, e = 1 - d;
+  const size_t size = quant ? sizeof(uint16_t) : sizeof(ESMBASE);
+  const hsize_t b0 = offset[d]/cdims[d], b1 = (offset[d] + count[d] - 1)/cdims[d];
+  const hsize_t k0 = offset[e]/cdims[e], k1 = (offset[e] + count[e] - 1)/cdims[e];
+  const size_t nk = (np + cdims[e] - 1)/cdims[e];
+  for( hsize_t b = b0 ; b <= b1 ; ++b )
+    {
+      if( b != band || chunks.size() != nk )
+	{
+	  chunks.assign(nk,vector<char>());
+	  band = b;
+	}
+      raw.resize(nk);
+      masks.assign(nk,0);
+      {
+	lock_guard<mutex> lock(hdf5_lock);
+	for( hsize_t k = k0 ; k <= k1 ; ++k )
+	  {
+	    if( !chunks[k].empty() ) { continue; }
+	    hsize_t origin[2];
+	    origin[d] = b*cdims[d];
+	    origin[e] = k*cdims[e];
+	    hsize_t nbytes = 0;
+	    if( H5Dget_chunk_storage_size(dset,origin,&nbytes) < 0 )
+	      {
+		throw runtime_error( fname + ": error reading permutations" );
+	      }
+	    raw[k].resize(nbytes);
+	    if( nbytes > 0 && H5Dread_chunk(dset,H5P_DEFAULT,origin,&masks[k],raw[k].data()) < 0 )
+	      {
+		throw runtime_error( fname + ": error reading permutations" );
+	      }
+	  }
+      }
+      for( hsize_t k = k0 ; k <= k1 ; ++k )
+	{
+	  if( chunks[k].empty() )
+	    {
+	      //the chunk is decompressed in place, and then kept in chunks, leaving raw[k] empty
+	      decode( raw[k], masks[k] );
+	      chunks[k].swap(raw[k]);
+	    }
+	  //copy out the part of the chunk that was asked for
+	  hsize_t origin[2], lo[2], hi[2];
+	  origin[d] = b*cdims[d];
+	  origin[e] = k*cdims[e];
+	  for( int i = 0 ; i < 2 ; ++i )
+	    {
+	      lo[i] = max(offset[i],origin[i]);
+	      hi[i] = min(offset[i] + count[i],origin[i] + cdims[i]);
+	    }
+	  for( hsize_t r = lo[0] ; r < hi[0] ; ++r )
+	    {
+	      const char * from = &chunks[k][((r - origin[0])*cdims[1] + (lo[1] - origin[1]))*size];
+	      store( from, hi[1] - lo[1], buffer + (r - offset[0])*ld + (lo[1] - offset[1]) );
+	    }
+	}
+    }
+}
+
+/*
+  Undoes the filters of the chunk in in, other than those mask says
+  were skipped, leaving in one whole chunk, as stored.  A chunk that
+  was never written is all zeros, HDF5's default fill value.
+*/
+void perm_reader::decode( vector<char> & in,
+			  const uint32_t & mask ) const
+{
+  const size_t size = quant ? sizeof(uint16_t) : sizeof(ESMBASE);
+  const size_t n = cdims[0]*cdims[1], nbytes = n*size;
+  if( in.empty() )
+    {
+      in.assign(nbytes,0);
+      return;
+    }
+  vector<char> tmp;
+  for( size_t i = filters.size() ; i-- > 0 ; )
+    {
+      if( mask & (1u << i) ) { continue; }
+      tmp.resize(nbytes);
+      if( filters[i] != H5Z_FILTER_SHUFFLE )
+	{
+	  if( !decode_chunk(filters[i],in,tmp,nbytes) )
+	    {
+	      throw runtime_error( fname + ": corrupt chunk in the permutations" );
+	    }
+	}
+      else
+	{
+	  //shuffle put byte j of every value together, so gather them back
+	  if( in.size() != nbytes )
+	    {
+	      throw runtime_error( fname + ": corrupt chunk in the permutations" );
+	    }
+	  for( size_t j = 0 ; j < size ; ++j )
+	    {
+	      const char * from = &in[j*n];
+	      for( size_t v = 0 ; v < n ; ++v )
+		{
+		  tmp[v*size + j] = from[v];
+		}
+	    }
+	}
+      in.swap(tmp);
+    }
+  if( in.size() != nbytes )
+    {
+      throw runtime_error( fname + ": corrupt chunk in the permutations" );
+    }
+}
+
+//read_slab, with scratch for transposing
+template<typename V>
+void perm_reader::read_rows( const size_t & start,
+			     const size_t & len,
+			     const size_t & firstperm,
+			     const size_t & nperms,
+			     V * buffer,
+			     vector<V> & scratch )
+{
+  if( len == 0 || nperms == 0 ) { return; }
+  if( firstperm + nperms > np )
+    {
+      throw runtime_error( fname + ": permutations out of range" );
+    }
+  if( !T )
+    {
+      read( start, len, firstperm, nperms, buffer, len );
+      return;
+    }
+  scratch.resize(nperms*len);
+  read( start, len, firstperm, nperms, &scratch[0], nperms );
+  for( size_t c = 0 ; c < len ; ++c )
+    {
+      for( size_t j = 0 ; j < nperms ; ++j )
+	{
+	  buffer[j*len + c] = scratch[c*nperms + j];
+	}
+    }
+}
+
+//read_columns, with scratch for transposing
+template<typename V>
+void perm_reader::read_cols( const size_t & start,
+			     const size_t & len,
+			     const size_t & firstperm,
+			     const size_t & nperms,
+			     V * buffer,
+			     const size_t & stride,
+			     vector<V> & scratch )
+{
+  if( len == 0 || nperms == 0 ) { return; }
+  if( firstperm + nperms > np )
+    {
+      throw runtime_error( fname + ": permutations out of range" );
+    }
+  if( T )
+    {
+      //HDF5 can place the columns at the right stride itself
+      read( start, len, firstperm, nperms, buffer, stride );
+      return;
+    }
+  scratch.resize(nperms*len);
+  read( start, len, firstperm, nperms, &scratch[0], len );
+  for( size_t j = 0 ; j < nperms ; ++j )
+    {
+      for( size_t c = 0 ; c < len ; ++c )
+	{
+	  buffer[c*stride + j] = scratch[j*len + c];
+	}
+    }
+}
+
+void perm_reader::read_slab( const size_t & start,
+			     const size_t & len,
+			     ESMBASE * buffer )
+{
+  read_slab( start, len, 0, np, buffer );
+}
+
+void perm_reader::read_slab( const size_t & start,
+			     const size_t & len,
+			     const size_t & firstperm,
+			     const size_t & nperms,
+			     ESMBASE * buffer )
+{
+  read_rows( start, len, firstperm, nperms, buffer, scratch );
+}
+
+void perm_reader::read_slab( const size_t & start,
+			     const size_t & len,
+			     const size_t & firstperm,
+			     const size_t & nperms,
+			     uint16_t * buffer )
+{
+  if( !quant )
+    {
+      throw runtime_error( fname + ": the permutations are not quantized" );
+    }
+  read_rows( start, len, firstperm, nperms, buffer, tscratch );
+}
+
+void perm_reader::read_columns( const size_t & start,
+				const size_t & len,
+				ESMBASE * buffer,
+				const size_t & stride )
+{
+  read_columns( start, len, 0, np, buffer, stride );
+}
+
+void perm_reader::read_columns( const size_t & start,
+				const size_t & len,
+				const size_t & firstperm,
+				const size_t & nperms,
+				ESMBASE * buffer,
+				const size_t & stride )
+{
+  read_cols( start, len, firstperm, nperms, buffer, stride, scratch );
+}
+
+void perm_reader::read_columns( const size_t & start,
+				const size_t & len,
+				const size_t & firstperm,
+				const size_t & nperms,
+				uint16_t * buffer,
+				const size_t & stride )
+{
+  if( !quant )
+    {
+      throw runtime_error( fname + ": the permutations are not quantized" );
+    }
+  read_cols( start, len, firstperm, nperms, buffer, stride, tscratch );
+}
+
 vector<ESMBASE> read_doubles_slab( const char * filename, 
 				   const char * dsetname,
 				   const size_t & start,
@@ -95,60 +627,230 @@ vector<ESMBASE> read_doubles_slab( const char * filename,
 				   const size_t & cperms,
 				   const size_t & nperms)
 {
-  size_t nchunks = (nperms/cperms)*(len/cmarkers + 1);
-  size_t ccache = nchunks*cperms*cmarkers*4;
-  size_t rdcc = 10*nchunks;
-  firstprime(rdcc);
-  FileAccPropList fapl;
-  fapl.setCache(23,rdcc,ccache,0); 
-  /*NOTE:
-    1)not sure how metadata cache works
-    2)2089 = prime> 10*NCHUNKS/SLAB, assumes 2 million persm with 10K chunks and approx 1 CHUNK per window 
-   */
-  H5File ifile( filename, H5F_ACC_RDONLY,H5P_DEFAULT,fapl );
-  DataSet ds( ifile.openDataSet(dsetname) );
-  DataSpace dsp(ds.getSpace());
-  int rank_j = dsp.getSimpleExtentNdims();
-  hsize_t dims_out[rank_j];
-  int ndims = dsp.getSimpleExtentDims( dims_out, NULL);  
-  //*Define the hyperslab in the dataset; see readdata.cpp in 
-  // the HDF5 group c++ API
-  hsize_t offset[2];
-  hsize_t count[2];
-  offset[0]= 0;
-  offset[1]= start;
-  count[0] = dims_out[0];
-  count[1]= len;
-  //should select a hyperslab which ds.read can reference
-  dsp.selectHyperslab(H5S_SELECT_SET,count,offset);
-  
-  //define memspace
+  perm_reader R( filename, dsetname, cmarkers, cperms );
+  const size_t n = ( nperms == 0 ) ? R.nperms() : min(nperms,R.nperms());
+  vector<ESMBASE> receiver(n*len); //allocate memory to receive
+  R.read_slab( start, len, 0, n, receiver.data() );
+  return receiver;
+}
 
-  hsize_t dimsm[2];
-  dimsm[0]=dims_out[0];
-  dimsm[1]=len;
-  DataSpace memspace(2,dimsm);
+column_writer::column_writer( const char * filename ) : file(-1),
+							 dsets(),
+							 types(),
+							 rows()
+{
+  lock_guard<mutex> lock(hdf5_lock);
+  file = H5Fcreate( filename, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT );
+  if( file < 0 )
+    {
+      throw runtime_error( string("could not create ") + filename );
+    }
+}
 
-  //define hyperslab in memory...this is done so you can go from
-  //high dimensions to lower ones while still in H5
+column_writer::~column_writer()
+{
+  try
+    {
+      close();
+    }
+  catch( const runtime_error & )
+    {
+    }
+}
 
-  hsize_t offset_out[2]; //mem offset
-  hsize_t count_out[2]; //
+size_t column_writer::add_column( const char * dsetname,
+				  const column_type & type,
+				  const size_t & width )
+{
+  lock_guard<mutex> lock(hdf5_lock);
+  hid_t memtype;
+  if( type == STRINGS )
+    {
+      memtype = H5Tcopy(H5T_C_S1);
+      H5Tset_size(memtype,max(width,size_t(1)));
+      H5Tset_strpad(memtype,H5T_STR_NULLPAD);
+    }
+  else
+    {
+      memtype = H5Tcopy( (type == INTS) ? H5T_NATIVE_INT : esmbase_memtype() );
+    }
+  //Rows go in a chunk at a time, and the columns grow without limit
+  hsize_t dims[1] = {0}, maxdims[1] = {H5S_UNLIMITED}, chunk[1] = {4096};
+  hid_t space = H5Screate_simple(1,dims,maxdims);
+  hid_t cparms = H5Pcreate(H5P_DATASET_CREATE);
+  H5Pset_chunk(cparms,1,chunk);
+  H5Pset_deflate(cparms,6);
+  hid_t dset = H5Dcreate2(file,dsetname,memtype,space,H5P_DEFAULT,cparms,H5P_DEFAULT);
+  H5Pclose(cparms);
+  H5Sclose(space);
+  if( dset < 0 )
+    {
+      H5Tclose(memtype);
+      throw runtime_error( string("could not create ") + dsetname );
+    }
+  dsets.push_back(dset);
+  types.push_back(memtype);
+  rows.push_back(0);
+  return dsets.size()-1;
+}
 
-  offset_out[0] = 0;
-  offset_out[1] = 0;
-  count_out[0]  = dims_out[0];
-  count_out[1]  = len;
-  
-  memspace.selectHyperslab( H5S_SELECT_SET, count_out, offset_out );
-  
+void column_writer::append( const size_t & i,
+			    const char * data,
+			    const size_t & n )
+{
+  append(i,static_cast<const void *>(data),n);
+}
 
-  vector<ESMBASE> receiver(dims_out[0]*len); //allocate memory to receive
-  IntType intype = ds.getIntType();
-  ds.read( &receiver[0], intype, memspace, dsp);
-  return receiver;
+void column_writer::append( const size_t & i,
+			    const int * data,
+			    const size_t & n )
+{
+  append(i,static_cast<const void *>(data),n);
+}
+
+void column_writer::append( const size_t & i,
+			    const ESMBASE * data,
+			    const size_t & n )
+{
+  append(i,static_cast<const void *>(data),n);
+}
+
+void column_writer::append( const size_t & i,
+			    const void * data,
+			    const size_t & n )
+{
+  if( n == 0 ) { return; }
+  lock_guard<mutex> lock(hdf5_lock);
+  hsize_t size[1] = {rows[i] + n}, start[1] = {rows[i]}, count[1] = {n};
+  herr_t status = H5Dset_extent(dsets[i],size);
+  hid_t fspace = H5Dget_space(dsets[i]);
+  hid_t mspace = H5Screate_simple(1,count,NULL);
+  if( status >= 0 )
+    {
+      status = H5Sselect_hyperslab(fspace,H5S_SELECT_SET,start,NULL,count,NULL);
+    }
+  if( status >= 0 )
+    {
+      status = H5Dwrite(dsets[i],types[i],mspace,fspace,H5P_DEFAULT,data);
+    }
+  H5Sclose(mspace);
+  H5Sclose(fspace);
+  if( status < 0 )
+    {
+      throw runtime_error( "could not write to an HDF5 column" );
+    }
+  rows[i] += n;
 }
 
+void column_writer::close( void )
+{
+  lock_guard<mutex> lock(hdf5_lock);
+  for( size_t i = 0 ; i < dsets.size() ; ++i )
+    {
+      H5Dclose(dsets[i]);
+      H5Tclose(types[i]);
+    }
+  dsets.clear();
+  types.clear();
+  rows.clear();
+  herr_t status = 0;
+  if( file >= 0 )
+    {
+      status = H5Fclose(file);
+      file = -1;
+    }
+  if( status < 0 )
+    {
+      throw runtime_error( "could not close an HDF5 output file" );
+    }
+}
+
+vector<string> virtual_sources( const char * filename,
+				const char * dsetname,
+				vector<size_t> & nrows )
+{
+  lock_guard<mutex> lock(hdf5_lock);
+  vector<string> rv;
+  nrows.clear();
+  hid_t file = H5Fopen( filename, H5F_ACC_RDONLY, H5P_DEFAULT );
+  if( file < 0 ) { return rv; }
+  if( H5Lexists(file,dsetname,H5P_DEFAULT) <= 0 )
+    {
+      H5Fclose(file);
+      return rv;
+    }
+  hid_t dset = H5Dopen2( file, dsetname, H5P_DEFAULT );
+  hid_t dcpl = H5Dget_create_plist( dset );
+  hid_t space = H5Dget_space( dset );
+  hsize_t dims[2] = {0,0};
+  size_t n = 0;
+  bool ok = ( H5Sget_simple_extent_ndims(space) == 2 && H5Pget_layout(dcpl) == H5D_VIRTUAL &&
+	      H5Pget_virtual_count(dcpl,&n) >= 0 && n > 0 );
+  H5Sget_simple_extent_dims( space, dims, NULL );
+  const string name(filename);
+  const string dir = name.substr(0,name.rfind('/') == string::npos ? 0 : name.rfind('/')+1);
+  hsize_t row = 0;
+  for( size_t i = 0 ; i < n && ok ; ++i )
+    {
+      //the mapping must be all of the source onto the rows after the last one's
+      hid_t vspace = H5Pget_virtual_vspace( dcpl, i ), srcspace = H5Pget_virtual_srcspace( dcpl, i );
+      hsize_t lo[2], hi[2];
+      ok = ( H5Sget_select_bounds(vspace,lo,hi) >= 0 && lo[0] == row && lo[1] == 0 && hi[1] + 1 == dims[1] &&
+	     H5Sget_select_npoints(vspace) == hssize_t((hi[0] - lo[0] + 1)*dims[1]) &&
+	     H5Sget_select_type(srcspace) == H5S_SEL_ALL );
+      H5Sclose(vspace);
+      H5Sclose(srcspace);
+      if( !ok ) { break; }
+      nrows.push_back( hi[0] - lo[0] + 1 );
+      row = hi[0] + 1;
+      vector<char> src( max(H5Pget_virtual_filename(dcpl,i,NULL,0),ssize_t(0)) + 1, '\0' );
+      vector<char> srcdset( max(H5Pget_virtual_dsetname(dcpl,i,NULL,0),ssize_t(0)) + 1, '\0' );
+      H5Pget_virtual_filename( dcpl, i, src.data(), src.size() );
+      H5Pget_virtual_dsetname( dcpl, i, srcdset.data(), srcdset.size() );
+      string s(src.data());
+      //"." is the virtual dataset's own file
+      ok = ( s != "." && string(srcdset.data()) == dsetname );
+      if( !s.empty() && s[0] != '/' && !dir.empty() && ifstream((dir + s).c_str()).good() )
+	{
+	  s = dir + s;
+	}
+      rv.push_back(s);
+    }
+  ok = ok && row == dims[0];
+  H5Sclose(space);
+  H5Pclose(dcpl);
+  H5Dclose(dset);
+  H5Fclose(file);
+  if( !ok )
+    {
+      rv.clear();
+      nrows.clear();
+    }
+  return rv;
+}
+
+bool has_dataset( const char * filename,
+		  const char * dsetname )
+{
+  lock_guard<mutex> lock(hdf5_lock);
+  //H5Fis_hdf5 and H5Lexists say so themselves when the answer is no
+  H5E_auto2_t func;
+  void * data;
+  H5Eget_auto2(H5E_DEFAULT,&func,&data);
+  H5Eset_auto2(H5E_DEFAULT,NULL,NULL);
+  bool rv = false;
+  if( H5Fis_hdf5(filename) > 0 )
+    {
+      hid_t file = H5Fopen( filename, H5F_ACC_RDONLY, H5P_DEFAULT );
+      if( file >= 0 )
+	{
+	  rv = ( H5Lexists(file,dsetname,H5P_DEFAULT) > 0 );
+	  H5Fclose(file);
+	}
+    }
+  H5Eset_auto2(H5E_DEFAULT,func,data);
+  return rv;
+}
 
 void write_strings( const std::vector<string> & data,
 		    const char * dsetname,
@@ -223,28 +925,32 @@ void write_doubles ( const vector<ESMBASE> & data ,
 
 void firstprime (size_t & num)
 {
-  size_t count = 0;
-  bool prime = false;
-  while ( prime == false )
+  //trial division by odd numbers up to sqrt(num)
+  if ( num <= 2 )
     {
-      count = 0;
-
-      for (size_t i=2;i<num;i++)
+      num = 2;
+      return;
+    }
+  if ( num%2 == 0 )
+    {
+      num++;
+    }
+  while ( true )
+    {
+      bool prime = true;
+      for (size_t i=3;i*i<=num;i+=2)
         {
-
           if (num%i==0)
             {
-              count++;
+	      prime = false;
+	      break;
             }
         }
-      if ( count == 0 )
+      if ( prime )
         {
-          prime = true;
+          return;
         }
-      else
-        {
-          num++;
-	}
+      num += 2;
     }
 }
 
@@ -4,6 +4,7 @@
 #include <H5Cpp.h>
 #include <vector>
 #include <string>
+#include <cstdint>
 #include <ESMH5type.hpp>
 
 std::vector< std::string > read_strings( const char * filename, 
@@ -15,6 +16,17 @@ std::vector<int> read_ints( const char * filename,
 std::vector<ESMBASE> read_doubles(const char * filename, 
 				 const char * dsetname );
 
+/*
+  Read the first nperms perms (all of them if nperms is 0 or more
+  than the file has) for markers start ... start+len-1 of the
+  permutation matrix in dsetname, which is [nperms x nmarkers],
+  perm-major (perm j, marker k is at len*j + k).
+
+  If the file instead has dsetname_T, which is the [nmarkers x nperms]
+  transpose written by perms2h5 --transpose, that is read instead.
+
+  This opens the file for each call; see perm_reader for repeated reads.
+*/
 std::vector<ESMBASE> read_doubles_slab(const char * filename,
 				       const char * dsetname,
 				       const size_t & start,
@@ -23,6 +35,211 @@ std::vector<ESMBASE> read_doubles_slab(const char * filename,
 				       const size_t & cperms,
 				       const size_t & nperms);
 
+/*
+  Keeps a permutation file open for repeated reads of bands of markers,
+  so that the file, the dataset and its chunk cache stay open for the
+  whole run.  Either layout of the permutation matrix is read, as for
+  read_doubles_slab.  The chunk dimensions are taken from the file,
+  and cmarkers and cperms are only used if it is not chunked.
+
+  Reads go into caller-provided buffers, which must have room for
+  nperms()*len values.  Throws std::runtime_error if the file or
+  dataset cannot be opened or read.
+
+  Calls into HDF5 from all perm_readers are serialized on one lock,
+  so different readers can be used from different threads, but an
+  object must only be used by one thread at a time.  When the chunks
+  are stored with the filters perms2h5 uses (shuffle and deflate, lz4
+  or zstd, or none) and the file's type is ESMBASE, only the raw chunks are read
+  under the lock, a band of chunks at a time, and they are
+  decompressed on the calling thread, so readers of different files
+  decompress in parallel.  Otherwise H5Dread does it under the lock.
+
+  Perms stored by perms2h5 --quantize, as 16-bit integers q with
+  attributes scale and offset, are read as offset + scale*q, or as
+  they are stored into uint16_t buffers, which take half the memory.
+  Their values are then dequantization_table()[q].
+*/
+class perm_reader
+{
+public:
+  perm_reader( const char * filename,
+	       const char * dsetname,
+	       const size_t & cmarkers,
+	       const size_t & cperms );
+  ~perm_reader();
+  size_t nperms( void ) const;
+  size_t nmarkers( void ) const;
+  //true if the file is [nmarkers x nperms]
+  bool transposed( void ) const;
+  //true if the perms are stored as 16-bit integers
+  bool quantized( void ) const;
+  //The value of each of the 65536 integers, as read_slab gives them, or nothing if the perms are not quantized
+  std::vector<ESMBASE> dequantization_table( void ) const;
+  //perm-major: perm j, marker k is at buffer[len*j + k]
+  void read_slab( const size_t & start,
+		  const size_t & len,
+		  ESMBASE * buffer );
+  //The same, for perms firstperm ... firstperm+nperms-1 only; buffer needs room for nperms*len values
+  void read_slab( const size_t & start,
+		  const size_t & len,
+		  const size_t & firstperm,
+		  const size_t & nperms,
+		  ESMBASE * buffer );
+  //The same, for quantized perms, as the stored integers; throws if the perms are not quantized
+  void read_slab( const size_t & start,
+		  const size_t & len,
+		  const size_t & firstperm,
+		  const size_t & nperms,
+		  std::uint16_t * buffer );
+  //marker-major: perm j, marker k is at buffer[stride*k + j], with stride >= nperms()
+  void read_columns( const size_t & start,
+		     const size_t & len,
+		     ESMBASE * buffer,
+		     const size_t & stride );
+  //The same, for perms firstperm ... firstperm+nperms-1 only, with stride >= nperms
+  void read_columns( const size_t & start,
+		     const size_t & len,
+		     const size_t & firstperm,
+		     const size_t & nperms,
+		     ESMBASE * buffer,
+		     const size_t & stride );
+  //The same, for quantized perms, as the stored integers; throws if the perms are not quantized
+  void read_columns( const size_t & start,
+		     const size_t & len,
+		     const size_t & firstperm,
+		     const size_t & nperms,
+		     std::uint16_t * buffer,
+		     const size_t & stride );
+private:
+  hid_t file,dset,fspace;
+  //the file's name, for error messages
+  std::string fname;
+  bool T;
+  size_t np,nm;
+  std::vector<ESMBASE> scratch;
+  //the chunk dimensions, and whether the chunks are decompressed here
+  hsize_t cdims[2];
+  bool direct;
+  //whether the values are quantized, and how to get them back
+  bool quant;
+  double qscale,qoffset;
+  //quantized values on their way to an ESMBASE buffer, and on their way to a transposed uint16_t one
+  std::vector<uint16_t> qscratch,tscratch;
+  std::vector<H5Z_filter_t> filters;
+  /*
+    The decompressed chunks of the last band of chunks (the chunks
+    with the same markers) read, which the next read may start in,
+    as they are stored (so quantized ones stay 16-bit).  chunks[k] is
+    the k-th chunk of the band along the perms, and is empty if it
+    has not been read.
+  */
+  hsize_t band;
+  std::vector< std::vector<char> > chunks;
+  //the raw chunks of the band being read, each freed once it is decompressed
+  std::vector< std::vector<char> > raw;
+  std::vector<uint32_t> masks;
+  //V is ESMBASE, or uint16_t for quantized perms as they are stored
+  template<typename V>
+  void read( const size_t & start,
+	     const size_t & len,
+	     const size_t & firstperm,
+	     const size_t & nperms,
+	     V * buffer,
+	     const size_t & stride );
+  template<typename V>
+  void read_direct( const hsize_t * offset,
+		    const hsize_t * count,
+		    V * buffer,
+		    const size_t & ld );
+  template<typename V>
+  void read_rows( const size_t & start,
+		  const size_t & len,
+		  const size_t & firstperm,
+		  const size_t & nperms,
+		  V * buffer,
+		  std::vector<V> & scratch );
+  template<typename V>
+  void read_cols( const size_t & start,
+		  const size_t & len,
+		  const size_t & firstperm,
+		  const size_t & nperms,
+		  V * buffer,
+		  const size_t & stride,
+		  std::vector<V> & scratch );
+  void decode( std::vector<char> & in,
+	       const uint32_t & mask ) const;
+  void store( const char * from,
+	      const size_t & n,
+	      ESMBASE * to ) const;
+  void store( const char * from,
+	      const size_t & n,
+	      std::uint16_t * to ) const;
+  perm_reader( const perm_reader & );
+  perm_reader & operator=( const perm_reader & );
+};
+
+/*
+  Writes a table to an HDF5 file as one 1-d dataset per column, so
+  that rows can be appended as they are made.  The datasets are
+  chunked, compressed and extendible, and are added with add_column
+  before the first rows are appended.  Strings are fixed-length, and
+  the columns can be read back with read_strings, read_ints and
+  read_doubles.
+
+  Calls into HDF5 share perm_reader's lock, so a column_writer can
+  be used while perm_readers are reading on other threads.  Throws
+  std::runtime_error if the file cannot be created or written.
+*/
+class column_writer
+{
+public:
+  enum column_type { STRINGS, INTS, FLOATS };
+  explicit column_writer( const char * filename );
+  ~column_writer();
+  //Adds an empty column, and returns its index.  width is the length of the strings in a STRINGS column.
+  size_t add_column( const char * dsetname,
+		     const column_type & type,
+		     const size_t & width = 0 );
+  //Appends n values to column i.  A STRINGS column takes n strings of its width, one after the other, padded with '\0'.
+  void append( const size_t & i,
+	       const char * data,
+	       const size_t & n );
+  void append( const size_t & i,
+	       const int * data,
+	       const size_t & n );
+  void append( const size_t & i,
+	       const ESMBASE * data,
+	       const size_t & n );
+  void close( void );
+private:
+  hid_t file;
+  std::vector<hid_t> dsets,types;
+  std::vector<hsize_t> rows;
+  void append( const size_t & i,
+	       const void * data,
+	       const size_t & n );
+  column_writer( const column_writer & );
+  column_writer & operator=( const column_writer & );
+};
+
+/*
+  If dsetname in filename is a virtual dataset made of whole datasets
+  dsetname of other files, stacked one after another along its rows,
+  as h5merge --virtual writes, returns those files in order, and the
+  number of rows of each in nrows.  A relative name is taken from the
+  directory of filename if there is such a file there, as HDF5 does.
+  Otherwise returns an empty vector, and the dataset is to be read as
+  it is.
+*/
+std::vector< std::string > virtual_sources( const char * filename,
+					    const char * dsetname,
+					    std::vector<size_t> & nrows );
+
+//true if filename is an HDF5 file with a dataset (or group) dsetname
+bool has_dataset( const char * filename,
+		  const char * dsetname );
+
 void write_strings( const std::vector<std::string> & data,
 			 const char * dsetname,
 			 H5::H5File ofile );
@@ -0,0 +1,159 @@
+#include <LDmatrix.hpp>
+#include <unordered_map>
+#include <algorithm>
+#include <utility>
+
+using namespace std;
+
+namespace
+{
+  typedef pair<unsigned,ESMBASE> ld_entry;
+
+  bool column_less( const ld_entry & x, const ld_entry & y )
+  {
+    return x.first < y.first;
+  }
+}
+
+LDmatrix::LDmatrix( const vector<string> & markers,
+		    const vector<string> & snpA,
+		    const vector<string> & snpB,
+		    const vector<ESMBASE> & rsq ) : rows(markers.size()+1,0),
+						    cols(),
+						    vals(),
+						    dropped(0)
+{
+  //Marker names can repeat, so a name can stand for more than one index
+  unordered_map< string, vector<unsigned> > index;
+  index.reserve(markers.size());
+  for( size_t i = 0 ; i < markers.size() ; ++i )
+    {
+      index[markers[i]].push_back(unsigned(i));
+    }
+  const size_t npairs_in = min( min(snpA.size(),snpB.size()), rsq.size() );
+  dropped = max( max(snpA.size(),snpB.size()), rsq.size() ) - npairs_in;
+
+  //Look each name up once
+  vector< const vector<unsigned> * > ia(npairs_in,nullptr),ib(npairs_in,nullptr);
+  for( size_t i = 0 ; i < npairs_in ; ++i )
+    {
+      unordered_map< string, vector<unsigned> >::const_iterator A = index.find(snpA[i]),
+	B = index.find(snpB[i]);
+      if( A != index.end() && B != index.end() )
+	{
+	  ia[i] = &A->second;
+	  ib[i] = &B->second;
+	}
+    }
+
+  //Count the entries in each row, then fill them in, in the order given
+  vector<size_t> fill(markers.size()+1,0);
+  for( int pass = 0 ; pass < 2 ; ++pass )
+    {
+      vector<ld_entry> entries( pass ? rows.back() : 0 );
+      for( size_t i = 0 ; i < npairs_in ; ++i )
+	{
+	  bool used = false;
+	  if( ia[i] != nullptr )
+	    {
+	      for( size_t x = 0 ; x < ia[i]->size() ; ++x )
+		{
+		  for( size_t y = 0 ; y < ib[i]->size() ; ++y )
+		    {
+		      const unsigned a = (*ia[i])[x], b = (*ib[i])[y];
+		      if( a < b )
+			{
+			  if( pass )
+			    {
+			      entries[fill[a]++] = make_pair(b,rsq[i]);
+			    }
+			  else
+			    {
+			      ++rows[a+1];
+			    }
+			  used = true;
+			}
+		    }
+		}
+	    }
+	  if( !pass && !used ) { ++dropped; }
+	}
+      if( !pass )
+	{
+	  for( size_t a = 0 ; a < markers.size() ; ++a )
+	    {
+	      rows[a+1] += rows[a];
+	      fill[a] = rows[a];
+	    }
+	  continue;
+	}
+
+      //Sort each row by column, keeping only the first value given for a pair
+      cols.reserve(entries.size());
+      vals.reserve(entries.size());
+      size_t start = 0;
+      for( size_t a = 0 ; a < markers.size() ; ++a )
+	{
+	  vector<ld_entry>::iterator b = entries.begin() + start,
+	    e = entries.begin() + rows[a+1];
+	  start = rows[a+1];
+	  stable_sort(b,e,column_less);
+	  rows[a] = cols.size();
+	  for( vector<ld_entry>::iterator j = b ; j != e ; ++j )
+	    {
+	      if( cols.size() > rows[a] && cols.back() == j->first ) { continue; }
+	      cols.push_back(j->first);
+	      vals.push_back(j->second);
+	    }
+	}
+      rows.back() = cols.size();
+    }
+  cols.shrink_to_fit();
+  vals.shrink_to_fit();
+}
+
+ESMBASE LDmatrix::operator()( const size_t & a, const size_t & b ) const
+{
+  const size_t i = row_find(a,b);
+  return ( i < rows[a+1] && cols[i] == b ) ? vals[i] : ESMBASE(0);
+}
+
+size_t LDmatrix::row_begin( const size_t & a ) const
+{
+  return rows[a];
+}
+
+size_t LDmatrix::row_end( const size_t & a ) const
+{
+  return rows[a+1];
+}
+
+size_t LDmatrix::row_find( const size_t & a, const size_t & b ) const
+{
+  return lower_bound( cols.begin() + rows[a], cols.begin() + rows[a+1], b ) - cols.begin();
+}
+
+size_t LDmatrix::column( const size_t & i ) const
+{
+  return cols[i];
+}
+
+ESMBASE LDmatrix::value( const size_t & i ) const
+{
+  return vals[i];
+}
+
+size_t LDmatrix::npairs( void ) const
+{
+  return cols.size();
+}
+
+size_t LDmatrix::ndropped( void ) const
+{
+  return dropped;
+}
+
+size_t LDmatrix::bytes( void ) const
+{
+  return rows.capacity()*sizeof(size_t) + cols.capacity()*sizeof(unsigned) + vals.capacity()*sizeof(ESMBASE);
+}
@@ -0,0 +1,52 @@
+#ifndef __LDmatrix_HPP__
+#define __LDmatrix_HPP__
+
+#include <vector>
+#include <string>
+#include <cstddef>
+#include <ESMH5type.hpp>
+
+/*
+  Pairwise LD (r^2) between the markers of a chromosome, stored as
+  a sparse matrix in compressed sparse row form, keyed by marker
+  index rather than by marker name.
+
+  Row a holds the markers b > a that have an LD value with a,
+  sorted by b, so the pairs that fall inside a window are a
+  contiguous run of each row.
+
+  The matrix is built from the /LD lists.  As with looking up
+  (snpA,snpB) in a map of name pairs, a pair is only used if snpA
+  comes before snpB in markers, and the first value given for a
+  pair is the one kept.  Pairs naming markers that are not in
+  markers are dropped.
+*/
+class LDmatrix
+{
+public:
+  LDmatrix( const std::vector<std::string> & markers,
+	    const std::vector<std::string> & snpA,
+	    const std::vector<std::string> & snpB,
+	    const std::vector<ESMBASE> & rsq );
+  //The r^2 between markers a < b, or 0 if there is none
+  ESMBASE operator()( const std::size_t & a, const std::size_t & b ) const;
+  //Row a is entries row_begin(a) ... row_end(a)-1
+  std::size_t row_begin( const std::size_t & a ) const;
+  std::size_t row_end( const std::size_t & a ) const;
+  //The first entry of row a whose column is >= b
+  std::size_t row_find( const std::size_t & a, const std::size_t & b ) const;
+  std::size_t column( const std::size_t & i ) const;
+  ESMBASE value( const std::size_t & i ) const;
+  //The number of pairs stored, and the number of input pairs not used
+  std::size_t npairs( void ) const;
+  std::size_t ndropped( void ) const;
+  //Memory used by the matrix, in bytes
+  std::size_t bytes( void ) const;
+private:
+  std::vector<std::size_t> rows;
+  std::vector<unsigned> cols;
+  std::vector<ESMBASE> vals;
+  std::size_t dropped;
+};
+
+#endif
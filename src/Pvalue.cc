@@ -0,0 +1,248 @@
+#include <Pvalue.hpp>
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+
+/*
+  As for the ESM kernels, the AVX2 version is built with a target
+  attribute and used if the CPU has it.  It does the same operations
+  in the same order as the scalar one (no FMA), so the two give
+  identical results.
+*/
+#if defined(__GNUC__) && defined(__x86_64__)
+#define PVALUE_AVX2 1
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+namespace
+{
+  const double LN2 = 0.69314718055994530942;
+  const double LN10 = 2.30258509299404568402;
+  const double SQRT2 = 1.41421356237309504880;
+  //2/sqrt(pi)
+  const double TWO_SQRTPI = 1.12837916709551257390;
+  //below this z, -ln Q is summed from the series for erf
+  const double ZSMALL = 1e-3;
+  //2^52, and the exponent bias
+  const double TWO52 = 4503599627370496.0;
+  const double BIAS = 1023.0;
+
+  //Chebyshev coefficients of ln erfc(z) + z^2 - ln t in 4t-2, t = 2/(2+z)
+  const int NCHEB = 28;
+  const double cheb[NCHEB] = {
+    -1.30265371978170941e+00,
+    6.41969792356490210e-01,
+    1.94764732041858360e-02,
+    -9.56151478680863226e-03,
+    -9.46595344482036916e-04,
+    3.66839497852761447e-04,
+    4.25233248069077689e-05,
+    -2.02785781125342418e-05,
+    -1.62429000464702561e-06,
+    1.30365583558052324e-06,
+    1.56264417220661419e-08,
+    -8.52380959149265415e-08,
+    6.52905443909885149e-09,
+    5.05934349555146930e-09,
+    -9.91364156493033066e-10,
+    -2.27365122293183597e-10,
+    9.64679110201552702e-11,
+    2.39403808303911459e-12,
+    -6.88602752649755322e-12,
+    8.94487927309072531e-13,
+    3.13092139934295813e-13,
+    -1.12708223613672523e-13,
+    3.81090525518923205e-16,
+    7.10609761360923712e-15,
+    -1.52302820145710434e-15,
+    -9.45749457129123340e-17,
+    1.21023718922427899e-16,
+    -2.81666308774717710e-17
+  };
+
+  //1/(2k+1), for ln m = 2 atanh(s) = 2s SUM_k s^2k/(2k+1)
+  const int NATANH = 12;
+  const double atanh_coef[NATANH] = {
+    1., 1./3, 1./5, 1./7, 1./9, 1./11, 1./13, 1./15, 1./17, 1./19, 1./21, 1./23
+  };
+
+  inline double bits_to_double( const uint64_t & b )
+  {
+    double d;
+    memcpy(&d,&b,sizeof(d));
+    return d;
+  }
+
+  /*
+    ln a for a >= 1 (or +inf, which gives 1024 ln 2), from the bits of
+    a: a = 2^e m with m in [sqrt(2)/2,sqrt(2)], and ln m = 2 atanh(s)
+    with s = (m-1)/(m+1), |s| < 0.172, summed to s^23.
+  */
+  inline double log_ge1( const double & a )
+  {
+    uint64_t b;
+    memcpy(&b,&a,sizeof(b));
+    double e = bits_to_double((b >> 52) | 0x4330000000000000ULL) - (TWO52 + BIAS);
+    double m = bits_to_double((b & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL);
+    const bool big = m > SQRT2;
+    m = big ? 0.5*m : m;
+    e = big ? e + 1. : e;
+    const double s = (m - 1.)/(m + 1.), s2 = s*s;
+    double p = atanh_coef[NATANH-1];
+    for( int k = NATANH-2 ; k >= 0 ; --k )
+      {
+	p = p*s2 + atanh_coef[k];
+      }
+    return e*LN2 + 2.*s*p;
+  }
+
+  double log10p_scalar( const double & x )
+  {
+    const double v = (x > 0.) ? x : 0.;
+    const double z = sqrt(0.5*v);
+    //-ln Q = z^2 - ln t - g(t), with t = 1/(1+z/2)
+    const double a = 1. + 0.5*z;
+    const double t = 1./a, ty = 4.*t - 2.;
+    double d = 0., dd = 0.;
+    for( int j = NCHEB-1 ; j > 0 ; --j )
+      {
+	const double tmp = d;
+	d = ty*d + (cheb[j] - dd);
+	dd = tmp;
+      }
+    const double g = 0.5*(cheb[0] + ty*d) - dd;
+    const double big = 0.5*v + log_ge1(a) - g;
+    //-ln(1-e), e = erf z
+    const double z2 = z*z;
+    const double e = TWO_SQRTPI*z*(1. - z2*(1./3 - z2*(1./10)));
+    const double small = e*(1. + e*(1./2 + e*(1./3 + e*(1./4))));
+    const double r = ((z < ZSMALL) ? small : big)*(1./LN10);
+    return (x > 0.) ? r : ((x <= 0.) ? 0. : x);
+  }
+
+#ifdef PVALUE_AVX2
+  __attribute__((target("avx2"),always_inline))
+  inline __m256d log_ge1_avx2( const __m256d & a )
+  {
+    const __m256i b = _mm256_castpd_si256(a);
+    __m256d e = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(_mm256_srli_epi64(b,52),
+								   _mm256_set1_epi64x(0x4330000000000000LL))),
+			      _mm256_set1_pd(TWO52 + BIAS));
+    __m256d m = _mm256_castsi256_pd(_mm256_or_si256(_mm256_and_si256(b,_mm256_set1_epi64x(0x000fffffffffffffLL)),
+						    _mm256_set1_epi64x(0x3ff0000000000000LL)));
+    const __m256d big = _mm256_cmp_pd(m,_mm256_set1_pd(SQRT2),_CMP_GT_OQ);
+    m = _mm256_blendv_pd(m,_mm256_mul_pd(_mm256_set1_pd(0.5),m),big);
+    e = _mm256_blendv_pd(e,_mm256_add_pd(e,_mm256_set1_pd(1.)),big);
+    const __m256d one = _mm256_set1_pd(1.);
+    const __m256d s = _mm256_div_pd(_mm256_sub_pd(m,one),_mm256_add_pd(m,one)), s2 = _mm256_mul_pd(s,s);
+    __m256d p = _mm256_set1_pd(atanh_coef[NATANH-1]);
+    for( int k = NATANH-2 ; k >= 0 ; --k )
+      {
+	p = _mm256_add_pd(_mm256_mul_pd(p,s2),_mm256_set1_pd(atanh_coef[k]));
+      }
+    return _mm256_add_pd(_mm256_mul_pd(e,_mm256_set1_pd(LN2)),
+			 _mm256_mul_pd(_mm256_mul_pd(_mm256_set1_pd(2.),s),p));
+  }
+
+  /*
+    4W values, as log10p_scalar.  The Chebyshev sum is a chain of
+    dependent operations, so W of them are run side by side to keep
+    the pipeline full.
+  */
+  template<int W>
+  __attribute__((target("avx2"),always_inline))
+  inline void log10p_avx2( const float * x,
+			   float * out )
+  {
+    const __m256d zero = _mm256_setzero_pd(), half = _mm256_set1_pd(0.5), one = _mm256_set1_pd(1.);
+    __m256d xv[W], pos[W], v[W], z[W], a[W], ty[W], d[W], dd[W];
+    for( int k = 0 ; k < W ; ++k )
+      {
+	xv[k] = _mm256_cvtps_pd(_mm_loadu_ps(x + 4*k));
+	pos[k] = _mm256_cmp_pd(xv[k],zero,_CMP_GT_OQ);
+	v[k] = _mm256_and_pd(xv[k],pos[k]);
+	z[k] = _mm256_sqrt_pd(_mm256_mul_pd(half,v[k]));
+	a[k] = _mm256_add_pd(one,_mm256_mul_pd(half,z[k]));
+	const __m256d t = _mm256_div_pd(one,a[k]);
+	ty[k] = _mm256_sub_pd(_mm256_mul_pd(_mm256_set1_pd(4.),t),_mm256_set1_pd(2.));
+	d[k] = dd[k] = zero;
+      }
+    for( int j = NCHEB-1 ; j > 0 ; --j )
+      {
+	const __m256d c = _mm256_set1_pd(cheb[j]);
+	for( int k = 0 ; k < W ; ++k )
+	  {
+	    const __m256d tmp = d[k];
+	    d[k] = _mm256_add_pd(_mm256_mul_pd(ty[k],d[k]),_mm256_sub_pd(c,dd[k]));
+	    dd[k] = tmp;
+	  }
+      }
+    for( int k = 0 ; k < W ; ++k )
+      {
+	const __m256d g = _mm256_sub_pd(_mm256_mul_pd(half,_mm256_add_pd(_mm256_set1_pd(cheb[0]),_mm256_mul_pd(ty[k],d[k]))),dd[k]);
+	const __m256d big = _mm256_sub_pd(_mm256_add_pd(_mm256_mul_pd(half,v[k]),log_ge1_avx2(a[k])),g);
+	const __m256d z2 = _mm256_mul_pd(z[k],z[k]);
+	const __m256d e = _mm256_mul_pd(_mm256_mul_pd(_mm256_set1_pd(TWO_SQRTPI),z[k]),
+					_mm256_sub_pd(one,_mm256_mul_pd(z2,_mm256_sub_pd(_mm256_set1_pd(1./3),
+											 _mm256_mul_pd(z2,_mm256_set1_pd(1./10))))));
+	__m256d small = _mm256_add_pd(_mm256_set1_pd(1./3),_mm256_mul_pd(e,_mm256_set1_pd(1./4)));
+	small = _mm256_add_pd(_mm256_set1_pd(1./2),_mm256_mul_pd(e,small));
+	small = _mm256_add_pd(one,_mm256_mul_pd(e,small));
+	small = _mm256_mul_pd(e,small);
+	const __m256d r = _mm256_mul_pd(_mm256_blendv_pd(big,small,_mm256_cmp_pd(z[k],_mm256_set1_pd(ZSMALL),_CMP_LT_OQ)),
+					_mm256_set1_pd(1./LN10));
+	//x <= 0 gives 0; nan, which is neither, is passed on
+	const __m256d rv = _mm256_blendv_pd(_mm256_blendv_pd(xv[k],zero,_mm256_cmp_pd(xv[k],zero,_CMP_LE_OQ)),r,pos[k]);
+	_mm_storeu_ps(out + 4*k,_mm256_cvtpd_ps(rv));
+      }
+  }
+
+  __attribute__((target("avx2")))
+  void log10p_avx2( const float * x,
+		    float * out,
+		    const size_t & n )
+  {
+    size_t i = 0;
+    for( ; i + 8 <= n ; i += 8 )
+      {
+	log10p_avx2<2>(x + i,out + i);
+      }
+    for( ; i + 4 <= n ; i += 4 )
+      {
+	log10p_avx2<1>(x + i,out + i);
+      }
+  }
+
+  bool have_avx2( void )
+  {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+  }
+#endif
+}
+
+double chisq1_log10p( const double & x )
+{
+  return log10p_scalar(x);
+}
+
+void chisq1_log10p( const float * x,
+		    float * out,
+		    const size_t & n )
+{
+  size_t i = 0;
+#ifdef PVALUE_AVX2
+  static const bool avx2 = have_avx2();
+  if( avx2 )
+    {
+      log10p_avx2(x,out,n);
+      i = n - n%4;
+    }
+#endif
+  for( ; i < n ; ++i )
+    {
+      out[i] = float(log10p_scalar(x[i]));
+    }
+}
@@ -0,0 +1,332 @@
+#include <ResultWriter.hpp>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <ctime>
+#include <cstdlib>
+#include <algorithm>
+
+using namespace std;
+
+ResultWriter::format ResultWriter::pick_format( const string & name,
+						const string & filename )
+{
+  if( name == "text" ) { return TEXT; }
+  if( name == "gz" ) { return GZIP; }
+  if( name == "h5" ) { return HDF5; }
+  if( !name.empty() )
+    {
+      cerr << "Error: unknown output format " << name << "; it is one of text, gz or h5.\n";
+      exit(10);
+    }
+  const size_t dot = filename.rfind('.');
+  const string ext = (dot == string::npos) ? string() : filename.substr(dot+1);
+  if( ext == "gz" ) { return GZIP; }
+  if( ext == "h5" || ext == "hdf5" ) { return HDF5; }
+  return TEXT;
+}
+
+ResultWriter::ResultWriter( const string & filename,
+			    const format & f,
+			    const vector<string> & chroms,
+			    const bool & with_used ) : fmt(f),
+						       names(chroms),
+						       used(with_used),
+						       m(),
+						       head(0),
+						       finished(chroms.size(),false),
+						       held(chroms.size()),
+						       failed(false),
+						       closed(false),
+						       text(),
+						       gz(NULL),
+						       blocks(64),
+						       compressor(),
+						       h5(),
+						       h5chr(0),h5p(0),h5mid(0),h5used(0),
+						       width(1),
+						       h5chr_rows(),
+						       h5rows()
+{
+  ostringstream header;
+  header << "chr"<<' '<<"p.values"<<' '<<"loci.midpoint";
+  if( used ) { header << ' ' << "perms.used"; }
+  header << '\n';
+  bool ok = true;
+  if( fmt == TEXT )
+    {
+      text.open(filename.c_str());
+      text << header.str() << flush;
+      ok = bool(text);
+    }
+  else if( fmt == GZIP )
+    {
+      gz = gzopen(filename.c_str(),"wb");
+      if( gz != NULL )
+	{
+	  gzbuffer(gz,1<<17);
+	  blocks.push(header.str());
+	  compressor = thread(&ResultWriter::compress,this);
+	}
+      ok = (gz != NULL);
+    }
+  else
+    {
+      try
+	{
+	  for( size_t c = 0 ; c < names.size() ; ++c )
+	    {
+	      width = max(width,names[c].size());
+	    }
+	  h5.reset(new column_writer(filename.c_str()));
+	  h5chr = h5->add_column("/chr",column_writer::STRINGS,width);
+	  h5p = h5->add_column("/p.values",column_writer::FLOATS);
+	  h5mid = h5->add_column("/loci.midpoint",column_writer::FLOATS);
+	  if( used ) { h5used = h5->add_column("/perms.used",column_writer::INTS); }
+	}
+      catch( const runtime_error & e )
+	{
+	  ok = false;
+	}
+    }
+  if( !ok )
+    {
+      cerr << "Error: could not create " << filename << ".\n";
+      exit(10);
+    }
+}
+
+ResultWriter::~ResultWriter()
+{
+  close();
+}
+
+void ResultWriter::write( const size_t & c,
+			  const ESMBASE * p_values,
+			  const ESMBASE * midpoints,
+			  const size_t * perms_used,
+			  const size_t & n )
+{
+  lock_guard<mutex> lock(m);
+  if( c == head )
+    {
+      emit(c,p_values,midpoints,perms_used,n);
+      return;
+    }
+  rows & R = held[c];
+  R.p_values.insert(R.p_values.end(),p_values,p_values+n);
+  R.midpoints.insert(R.midpoints.end(),midpoints,midpoints+n);
+  R.perms_used.insert(R.perms_used.end(),perms_used,perms_used+n);
+}
+
+void ResultWriter::finish( const size_t & c )
+{
+  lock_guard<mutex> lock(m);
+  finished[c] = true;
+  //the next chromosome that is not finished starts streaming, once what it has so far is out
+  while( head < names.size() && finished[head] )
+    {
+      ++head;
+      if( head < names.size() )
+	{
+	  rows & R = held[head];
+	  emit(head,R.p_values.data(),R.midpoints.data(),R.perms_used.data(),R.p_values.size());
+	  R = rows();
+	}
+    }
+}
+
+bool ResultWriter::close( void )
+{
+  lock_guard<mutex> lock(m);
+  if( closed ) { return !failed; }
+  closed = true;
+  //chromosomes that were never finished still have their rows written, in order
+  for( ; head < names.size() ; ++head )
+    {
+      rows & R = held[head];
+      emit(head,R.p_values.data(),R.midpoints.data(),R.perms_used.data(),R.p_values.size());
+    }
+  if( fmt == TEXT )
+    {
+      text.close();
+      if( !text ) { failed = true; }
+    }
+  else if( fmt == GZIP )
+    {
+      blocks.close();
+      compressor.join();
+      if( gzclose(gz) != Z_OK ) { failed = true; }
+      gz = NULL;
+    }
+  else
+    {
+      try
+	{
+	  append_h5();
+	  h5->close();
+	}
+      catch( const runtime_error & e )
+	{
+	  failed = true;
+	}
+    }
+  return !failed;
+}
+
+void ResultWriter::emit( const size_t & c,
+			 const ESMBASE * p_values,
+			 const ESMBASE * midpoints,
+			 const size_t * perms_used,
+			 const size_t & n )
+{
+  if( n == 0 ) { return; }
+  if( fmt == TEXT )
+    {
+      format_rows(text,c,p_values,midpoints,perms_used,n);
+      text.flush();
+    }
+  else if( fmt == GZIP )
+    {
+      ostringstream block;
+      format_rows(block,c,p_values,midpoints,perms_used,n);
+      blocks.push(block.str());
+    }
+  else
+    {
+      for( size_t i = 0 ; i < n ; ++i )
+	{
+	  h5chr_rows.insert(h5chr_rows.end(),names[c].begin(),names[c].end());
+	  h5chr_rows.resize(h5chr_rows.size() + width - names[c].size(),'\0');
+	}
+      h5rows.p_values.insert(h5rows.p_values.end(),p_values,p_values+n);
+      h5rows.midpoints.insert(h5rows.midpoints.end(),midpoints,midpoints+n);
+      h5rows.perms_used.insert(h5rows.perms_used.end(),perms_used,perms_used+n);
+      if( h5rows.p_values.size() >= 4096 )
+	{
+	  try
+	    {
+	      append_h5();
+	    }
+	  catch( const runtime_error & e )
+	    {
+	      failed = true;
+	    }
+	}
+    }
+}
+
+void ResultWriter::append_h5( void )
+{
+  const size_t n = h5rows.p_values.size();
+  h5->append(h5chr,h5chr_rows.data(),n);
+  h5->append(h5p,h5rows.p_values.data(),n);
+  h5->append(h5mid,h5rows.midpoints.data(),n);
+  if( used )
+    {
+      //perms.used is at most the number of perms, so it fits in an int
+      vector<int> used_int(h5rows.perms_used.begin(),h5rows.perms_used.end());
+      h5->append(h5used,used_int.data(),n);
+    }
+  h5chr_rows.clear();
+  h5rows.p_values.clear();
+  h5rows.midpoints.clear();
+  h5rows.perms_used.clear();
+}
+
+void ResultWriter::format_rows( ostream & out,
+				const size_t & c,
+				const ESMBASE * p_values,
+				const ESMBASE * midpoints,
+				const size_t * perms_used,
+				const size_t & n ) const
+{
+  for( size_t i = 0 ; i < n ; ++i )
+    {
+      out<<names[c]<<' '<<p_values[i]<<' '<<midpoints[i];
+      if( used ) { out << ' ' << perms_used[i]; }
+      out << '\n';
+    }
+}
+
+void ResultWriter::compress( void )
+{
+  string block;
+  time_t last = time(NULL);
+  while( blocks.pop(block) )
+    {
+      if( gzwrite(gz,block.data(),unsigned(block.size())) != int(block.size()) )
+	{
+	  failed = true;
+	}
+      if( time(NULL) != last )
+	{
+	  gzflush(gz,Z_SYNC_FLUSH);
+	  last = time(NULL);
+	}
+    }
+}
+
+bool read_results( const string & filename,
+		   string & header,
+		   bool & with_used,
+		   vector<string> & chr,
+		   vector<ESMBASE> & p_values,
+		   vector<ESMBASE> & midpoints,
+		   vector<size_t> & perms_used )
+{
+  if( has_dataset(filename.c_str(),"/p.values") )
+    {
+      vector<string> chr_in = read_strings(filename.c_str(),"/chr");
+      vector<ESMBASE> p_in = read_doubles(filename.c_str(),"/p.values"),
+	mid_in = read_doubles(filename.c_str(),"/loci.midpoint");
+      with_used = has_dataset(filename.c_str(),"/perms.used");
+      vector<int> used_in = with_used ? read_ints(filename.c_str(),"/perms.used") : vector<int>(p_in.size(),0);
+      if( chr_in.size() != p_in.size() || mid_in.size() != p_in.size() || used_in.size() != p_in.size() )
+	{
+	  return false;
+	}
+      header = with_used ? "chr p.values loci.midpoint perms.used" : "chr p.values loci.midpoint";
+      chr.insert(chr.end(),chr_in.begin(),chr_in.end());
+      p_values.insert(p_values.end(),p_in.begin(),p_in.end());
+      midpoints.insert(midpoints.end(),mid_in.begin(),mid_in.end());
+      perms_used.insert(perms_used.end(),used_in.begin(),used_in.end());
+      return true;
+    }
+
+  //text, gzipped or not; gzread passes plain text through as it is
+  gzFile in = gzopen(filename.c_str(),"rb");
+  if( in == NULL ) { return false; }
+  string line;
+  bool ok = true, first = true;
+  char buffer[4096];
+  while( ok && gzgets(in,buffer,sizeof(buffer)) != NULL )
+    {
+      line += buffer;
+      if( line.empty() || line[line.size()-1] != '\n' ) { continue; }
+      line.erase(line.size()-1);
+      istringstream fields(line);
+      if( first )
+	{
+	  header = line;
+	  string name;
+	  vector<string> columns;
+	  while( fields >> name ) { columns.push_back(name); }
+	  with_used = (columns.size() == 4);
+	  ok = (columns.size() >= 3 && columns.size() <= 4 && columns[0] == "chr");
+	  first = false;
+	}
+      else
+	{
+	  string name,p,mid,u("0");
+	  ok = bool(fields >> name >> p >> mid) && (!with_used || fields >> u);
+	  chr.push_back(name);
+	  p_values.push_back(ESMBASE(strtod(p.c_str(),NULL)));
+	  midpoints.push_back(ESMBASE(strtod(mid.c_str(),NULL)));
+	  perms_used.push_back(size_t(strtoull(u.c_str(),NULL,10)));
+	}
+      line.clear();
+    }
+  gzclose(in);
+  return ok && !first && line.empty();
+}
@@ -0,0 +1,122 @@
+#ifndef __ResultWriter_HPP__
+#define __ResultWriter_HPP__
+
+#include <vector>
+#include <string>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <fstream>
+#include <ostream>
+#include <cstddef>
+#include <zlib.h>
+#include <BoundedQueue.hpp>
+#include <H5util.hpp>
+#include <ESMH5type.hpp>
+
+/*
+  Writes esmk's results (chr, p.values, loci.midpoint and, with
+  --stop, perms.used) as they are made, rather than holding them all
+  until the end of the run.
+
+  The output is one of
+    TEXT: space-separated columns with a header line, as before;
+    GZIP: the same text, gzipped.  Rows are formatted on the calling
+    thread and compressed on a thread of the writer's own;
+    HDF5: one dataset per column, /chr, /p.values, /loci.midpoint
+    and /perms.used, for reading without parsing text.
+
+  Chromosomes are run side by side, but their rows are written in
+  the order of chroms.  Rows of the first chromosome not yet
+  finished go straight out; those of later chromosomes are held
+  until the chromosomes before them are finished.  So with one
+  chromosome at a time, nothing is held at all.
+
+  Text output is flushed after every call to write.  The gzip stream
+  is flushed (Z_SYNC_FLUSH) at most once a second, so that it is
+  readable up to the last second or so while the run goes on
+  without flushes costing compression when window sets are small.
+  HDF5 rows are appended a chunk (4096 rows) at a time.
+*/
+class ResultWriter
+{
+public:
+  enum format { TEXT, GZIP, HDF5 };
+  //The format called name (text, gz or h5), or if name is empty, the one filename's extension suggests
+  static format pick_format( const std::string & name,
+			     const std::string & filename );
+  //Exits with an error if filename cannot be created
+  ResultWriter( const std::string & filename,
+		const format & f,
+		const std::vector<std::string> & chroms,
+		const bool & with_used );
+  ~ResultWriter();
+  //Adds n rows for chromosome c, an index into chroms.  Thread-safe.
+  void write( const std::size_t & c,
+	      const ESMBASE * p_values,
+	      const ESMBASE * midpoints,
+	      const std::size_t * perms_used,
+	      const std::size_t & n );
+  //There are no more rows for chromosome c.  Thread-safe.
+  void finish( const std::size_t & c );
+  //Writes out anything still held and closes the file.  Returns false if any of it could not be written.
+  bool close( void );
+private:
+  struct rows
+  {
+    std::vector<ESMBASE> p_values,midpoints;
+    std::vector<std::size_t> perms_used;
+  };
+  const format fmt;
+  const std::vector<std::string> names;
+  const bool used;
+  std::mutex m;
+  //chromosomes before head are finished and written
+  std::size_t head;
+  std::vector<bool> finished;
+  std::vector<rows> held;
+  std::atomic<bool> failed;
+  bool closed;
+  std::ofstream text;
+  gzFile gz;
+  BoundedQueue<std::string> blocks;
+  std::thread compressor;
+  std::unique_ptr<column_writer> h5;
+  std::size_t h5chr,h5p,h5mid,h5used,width;
+  //rows waiting to be appended to the HDF5 columns
+  std::vector<char> h5chr_rows;
+  rows h5rows;
+  void append_h5( void );
+  void emit( const std::size_t & c,
+	     const ESMBASE * p_values,
+	     const ESMBASE * midpoints,
+	     const std::size_t * perms_used,
+	     const std::size_t & n );
+  void format_rows( std::ostream & out,
+		    const std::size_t & c,
+		    const ESMBASE * p_values,
+		    const ESMBASE * midpoints,
+		    const std::size_t * perms_used,
+		    const std::size_t & n ) const;
+  void compress( void );
+  ResultWriter( const ResultWriter & );
+  ResultWriter & operator=( const ResultWriter & );
+};
+
+/*
+  Reads back a file written by ResultWriter, in any of its formats,
+  appending its rows to the vectors.  with_used is set to whether the
+  file has perms.used, and header to its text header line (for HDF5,
+  the header the text output would have had).  Returns false if the
+  file cannot be read.
+*/
+bool read_results( const std::string & filename,
+		   std::string & header,
+		   bool & with_used,
+		   std::vector<std::string> & chr,
+		   std::vector<ESMBASE> & p_values,
+		   std::vector<ESMBASE> & midpoints,
+		   std::vector<std::size_t> & perms_used );
+
+#endif
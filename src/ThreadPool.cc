@@ -0,0 +1,155 @@
+#include <ThreadPool.hpp>
+
+using namespace std;
+
+//The pool and queue index of the current thread, if it is a worker
+static thread_local const ThreadPool * this_pool = nullptr;
+static thread_local unsigned this_queue = 0;
+
+ThreadPool::ThreadPool( const unsigned & nthreads ) : queued(0),
+						      pending(0),
+						      next_queue(0),
+						      stopping(false)
+{
+  const unsigned n = (nthreads > 0) ? nthreads : 1;
+  for( unsigned i = 0 ; i < n ; ++i )
+    {
+      queues.push_back( unique_ptr<task_queue>(new task_queue) );
+    }
+  for( unsigned i = 0 ; i < n ; ++i )
+    {
+      workers.push_back( thread(&ThreadPool::run,this,i) );
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    lock_guard<mutex> lock(m);
+    stopping = true;
+  }
+  work_cv.notify_all();
+  for( size_t i = 0 ; i < workers.size() ; ++i )
+    {
+      workers[i].join();
+    }
+}
+
+unsigned ThreadPool::size( void ) const
+{
+  return unsigned(workers.size());
+}
+
+void ThreadPool::submit( task_type task )
+{
+  {
+    //queued is updated while holding m so that a worker about to sleep cannot miss it
+    lock_guard<mutex> lock(m);
+    unsigned i = (this_pool == this) ? this_queue : (next_queue++ % queues.size());
+    ++pending;
+    lock_guard<mutex> qlock(queues[i]->m);
+    queues[i]->tasks.push_back(move(task));
+    ++queued;
+  }
+  work_cv.notify_one();
+}
+
+void ThreadPool::wait( void )
+{
+  unique_lock<mutex> lock(m);
+  done_cv.wait(lock,[this]{ return pending == 0; });
+}
+
+bool ThreadPool::pop( const unsigned & i, task_type & task )
+{
+  //own queue first, newest task first
+  {
+    lock_guard<mutex> lock(queues[i]->m);
+    if( !queues[i]->tasks.empty() )
+      {
+	task = move(queues[i]->tasks.back());
+	queues[i]->tasks.pop_back();
+	--queued;
+	return true;
+      }
+  }
+  //then steal the oldest task from somebody else
+  for( size_t k = 1 ; k < queues.size() ; ++k )
+    {
+      task_queue & Q = *queues[(i+k) % queues.size()];
+      lock_guard<mutex> lock(Q.m);
+      if( !Q.tasks.empty() )
+	{
+	  task = move(Q.tasks.front());
+	  Q.tasks.pop_front();
+	  --queued;
+	  return true;
+	}
+    }
+  return false;
+}
+
+void ThreadPool::run( const unsigned & i )
+{
+  this_pool = this;
+  this_queue = i;
+  task_type task;
+  while( true )
+    {
+      if( pop(i,task) )
+	{
+	  task();
+	  task = task_type();
+	  lock_guard<mutex> lock(m);
+	  if( --pending == 0 )
+	    {
+	      done_cv.notify_all();
+	    }
+	  continue;
+	}
+      unique_lock<mutex> lock(m);
+      work_cv.wait(lock,[this]{ return stopping || queued > 0; });
+      if( stopping && queued == 0 )
+	{
+	  return;
+	}
+    }
+}
+
+TaskGroup::TaskGroup( ThreadPool & pool_ ) : pool(pool_),
+					      pending(0)
+{
+}
+
+TaskGroup::~TaskGroup()
+{
+  wait();
+}
+
+void TaskGroup::submit( ThreadPool::task_type task )
+{
+  {
+    lock_guard<mutex> lock(m);
+    ++pending;
+  }
+  pool.submit( [this,task]() {
+      task();
+      //notify while holding m, so the group cannot be destroyed under us
+      lock_guard<mutex> lock(m);
+      if( --pending == 0 )
+	{
+	  done_cv.notify_all();
+	}
+    } );
+}
+
+void TaskGroup::wait( void )
+{
+  unique_lock<mutex> lock(m);
+  done_cv.wait(lock,[this]{ return pending == 0; });
+}
+
+unsigned TaskGroup::size( void ) const
+{
+  return pool.size();
+}
@@ -0,0 +1,85 @@
+#ifndef __ThreadPool_HPP__
+#define __ThreadPool_HPP__
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <memory>
+#include <cstddef>
+
+/*
+  A fixed-size pool of worker threads.
+
+  Each worker has its own queue of tasks.  A worker runs tasks from
+  the back of its own queue and, when that is empty, steals from the
+  front of the other workers' queues, so no core sits idle while
+  there is work queued anywhere.  Tasks submitted from outside the
+  pool are spread over the queues round-robin, and tasks submitted
+  by a running task go to the current worker's queue.
+
+  The workers live as long as the pool, so the cost of starting
+  threads is paid once per run rather than once per window set.
+*/
+class ThreadPool
+{
+public:
+  typedef std::function<void(void)> task_type;
+  explicit ThreadPool( const unsigned & nthreads );
+  ~ThreadPool();
+  //Queue a task to be run by one of the workers
+  void submit( task_type task );
+  //Block until every task submitted so far has finished
+  void wait( void );
+  //The number of worker threads
+  unsigned size( void ) const;
+private:
+  struct task_queue
+  {
+    std::mutex m;
+    std::deque<task_type> tasks;
+  };
+  std::vector< std::unique_ptr<task_queue> > queues;
+  std::vector<std::thread> workers;
+  std::mutex m;
+  std::condition_variable work_cv,done_cv;
+  //tasks waiting in a queue, and tasks not yet finished
+  std::atomic<std::size_t> queued;
+  std::size_t pending;
+  unsigned next_queue;
+  bool stopping;
+  void run( const unsigned & i );
+  bool pop( const unsigned & i, task_type & task );
+  ThreadPool( const ThreadPool & );
+  ThreadPool & operator=( const ThreadPool & );
+};
+
+/*
+  Tasks submitted to a shared pool through a TaskGroup can be waited
+  for on their own, so that several threads can each run their own
+  work on one pool without waiting for each other's tasks.
+  The destructor waits for the group's tasks.
+*/
+class TaskGroup
+{
+public:
+  explicit TaskGroup( ThreadPool & pool );
+  ~TaskGroup();
+  void submit( ThreadPool::task_type task );
+  //Block until every task submitted to this group so far has finished
+  void wait( void );
+  //The number of worker threads in the pool
+  unsigned size( void ) const;
+private:
+  ThreadPool & pool;
+  std::mutex m;
+  std::condition_variable done_cv;
+  std::size_t pending;
+  TaskGroup( const TaskGroup & );
+  TaskGroup & operator=( const TaskGroup & );
+};
+
+#endif
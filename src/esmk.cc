@@ -12,15 +12,23 @@
 #include <iostream>   //let's us print to screen
 #include <string>     //strings = containers of characters
 #include <fstream>    //let's us write to files
+#include <sstream>
 #include <vector>     //vectors = containers of other things
+#include <cstdio>
 #include <cmath>      //The C++ version of C's math.h (puts the C functions in namespace std)
 #include <algorithm>  //find, sort, etc.
 #include <set>        //A set is a container, see http://www.cplusplus.com/reference/set/set/
 #include <thread>
+#include <mutex>
+#include <atomic>
 #include <functional>
 #include <numeric>
 #include <unordered_map>
 #include <utility>
+#include <memory>
+#include <stdexcept>
+#include <exception>
+#include <chrono>
 /*
   This is a header that I wrote.
 
@@ -29,6 +37,12 @@
 */
 #include <H5util.hpp>
 #include <ESMH5type.hpp>
+#include <LDmatrix.hpp>
+#include <Checkpoint.hpp>
+#include <ResultWriter.hpp>
+#include <ESMkernel.hpp>
+#include <ThreadPool.hpp>
+#include <BoundedQueue.hpp>
 
 using namespace std;
 using namespace boost::program_options;
@@ -37,11 +51,18 @@ using namespace H5;
 //This is a data type to hold command-line options
 struct esm_options
 {
-  string outfile;
+  string outfile,format;
   int winsize,jumpsize,K,nwindows;
+  unsigned nthreads,prefetch,nchroms;
   size_t cmarkers,cperms,nperms;
+  size_t stop,stopblock;
   ESMBASE LDcutoff;
   vector<string> infiles;
+  string kernel;
+  bool incremental,nocache,verbose;
+  //run shard shard_i of shard_n (1 of 1 = everything)
+  unsigned shard_i,shard_n;
+  bool merge,resume;
 };
 
 struct within
@@ -69,35 +90,363 @@ struct within
 
   If no position exists satisfying one of these criteria,
   the maximum value of a size_t is returned.
+
+  If sorted is true, pos must be in increasing order, and the indexes
+  are found by binary search rather than by scanning pos from both ends.
  */
 pair<size_t,size_t> get_indexes( const vector<int> & pos,
 				 const int & left,
-				 const int & right );
+				 const int & right,
+				 const bool & sorted );
 //Parse command line options
 esm_options parseargs( int argc, char ** argv );
 //Ask if all the permutation files contain the same marker info
 bool permfilesOK( const esm_options & O );
 //Runs the esm_k test on the data
 
-void calc_esm( const vector<ESMBASE> * data,
+/*
+  A set of windows whose permutation data are read in together
+*/
+struct window_set
+{
+  //left boundary of the first window in the set
+  int left;
+  //indexes in pos_0 of the left- and right-most SNPs in the set
+  pair<size_t,size_t> indexes;
+  //perms firstperm ... firstperm+nperms-1 for those SNPs, counting
+  //over every file in turn, perm-major
+  size_t firstperm,nperms;
+  vector<ESMBASE> slab;
+  /*
+    When the files hold quantized perms, table is their dequantization
+    table, and the perms are kept in qslab as the 16-bit integers that
+    are stored, in place of slab, which takes twice the memory.  The
+    ESM kernels look the values up as they go.  Otherwise table is
+    nullptr.
+  */
+  vector<uint16_t> qslab;
+  const ESMBASE * table;
+  window_set( void ) : left(0),indexes(),firstperm(0),nperms(0),slab(),qslab(),table(nullptr) {}
+};
+
+/*
+  A window's permutation data, seen in place in the slab of its
+  window set: marker k of permutation j is slab[offset + stride*j + k],
+  for k < width.  Overlapping windows share the slab rather than
+  each holding its own copy.
+*/
+struct window_view
+{
+  size_t offset,stride,width;
+};
+
+//esm_exceedances for nperms perms of ws from index at of its slab on, whichever form they are kept in
+size_t view_exceedances( const window_set & ws,
+			 const size_t & at,
+			 const size_t & nperms,
+			 const int & nmarkers,
+			 const size_t & stride,
+			 const short * keep,
+			 const vector<ESMBASE> & offsets,
+			 const ESMBASE & ESM_obs );
+
+void calc_esm( const window_set * ws,
+	       const window_view & view,
 	       const ESMBASE & ESM_obs,
 	       const size_t & nperms,
-	       const int & nmarkers,
 	       const int & K,
 	       ESMBASE * ESMP_win,
 	       const vector<short> & keep_markers_win);
 
+/*
+  One block of perms of a window for sequential stopping (--stop).
+  The slab of ws holds nperms perms.  Exceedances are added to nexceed and
+  the perms looked at to used, stopping at the perm that brings
+  nexceed up to stop, if there is one.
+*/
+void calc_esm_sequential( const window_set * ws,
+			  const window_view & view,
+			  const ESMBASE & ESM_obs,
+			  const size_t & nperms,
+			  const int & K,
+			  const vector<short> & keep_markers_win,
+			  const size_t & stop,
+			  size_t * nexceed,
+			  size_t * used );
+
+/*
+  Runs the incremental ESM_k scan over a set of windows
+  for nperms permutations in the slab of ws, starting at firstperm.
+  See esm_scan_exceedances in ESMkernel.hpp.
+*/
+void calc_esm_scan( const window_set * ws,
+		    const size_t & nmarkers_set,
+		    const size_t & firstperm,
+		    const size_t & nperms,
+		    const vector< pair<size_t,size_t> > * windows,
+		    const vector< vector<short> > * keep,
+		    const vector< vector<ESMBASE> > * offsets,
+		    const vector<ESMBASE> * ESM_obs,
+		    vector<size_t> * nexceed );
+
+/*
+  Starting from left, finds the next set of windows that has SNPs in it.
+  Windows with a left boundary > last_left are left out.
+  On return, left is the left boundary of the set after that one.
+  Returns false when there are no more windows.
+*/
+bool next_window_set( const esm_options & O,
+		      const vector<int> & pos,
+		      const bool & sorted,
+		      const int & last_left,
+		      int & left,
+		      window_set & ws );
+
+//The permutation files in O.infiles, or the files of a view of them, in order, each kept open for the whole run
+typedef vector< unique_ptr<perm_reader> > perm_files;
+
+/*
+  Opens the files of O.infiles, or the files of the views among them,
+  in order.  Reports the error and exits with status 10 if one cannot
+  be opened.
+*/
+perm_files open_perm_files( const esm_options & O );
+
+/*
+  The dequantization table of the perms in files if they are all
+  quantized the same way, so that they can be kept in memory as the
+  16-bit integers that are stored (see window_set).  Otherwise an
+  empty vector, and they are read as ESMBASE values.
+*/
+vector<ESMBASE> shared_dequantization_table( const perm_files & files );
+
+/*
+  Runs read(i) for every file i that pool is given for, on the pool,
+  one task per file, and returns when all have finished.  Without a
+  pool, the files are done one after another on this thread.  The
+  first exception thrown by a task is thrown again here.
+*/
+void for_each_file( const perm_files & files,
+		    ThreadPool * pool,
+		    const function<void(const size_t &)> & read );
+
+/*
+  Reads perms firstperm ... firstperm+nperms-1 for ws, straight into
+  ws.slab (or ws.qslab if ws.table is set), each file's perms into
+  their own rows of it, with the files read in parallel on pool if it
+  is not nullptr.
+*/
+void read_window_set( perm_files & files,
+		      window_set & ws,
+		      const size_t & firstperm,
+		      const size_t & nperms,
+		      ThreadPool * pool = nullptr );
+
+/*
+  Permutation data for a contiguous range of markers, kept from one
+  window set to the next, one column (all perms from every file) per
+  marker.  Consecutive sets overlap whenever winsize > jumpsize*nwindows,
+  and only the markers that were not in the previous set are read
+  from the files.
+
+  The columns live in one ring buffer, marker m in slot m % capacity,
+  so columns that fall off the left are overwritten in place by the
+  new ones on the right and nothing is allocated once it is big enough.
+  Quantized perms that the window sets keep as 16-bit integers are
+  cached that way too.
+
+  The ring is a second copy of the set's perms, column-major, next to
+  the slab it is laid out into, so the cache costs one set's worth of
+  memory beyond the O.prefetch+1 slabs; --nocache saves it.  The slab
+  is copied out rather than the kernels reading the ring, because the
+  prefetch thread refills the ring while the current set is worked on.
+*/
+class column_cache
+{
+public:
+  column_cache( void );
+  //Same as read_window_set for perms 0 ... nperms-1, but only reads markers not already cached
+  void fill( perm_files & files, const size_t & nperms, window_set & ws, ThreadPool * pool = nullptr );
+  //columns taken from the cache and columns read from the files
+  size_t hits,misses;
+private:
+  //marker index of the first cached column, and the number cached
+  size_t first,ncols;
+  //slots in the ring, and values per column (total perms)
+  size_t capacity,stride;
+  //where each file's perms start in a column, and how many of them are used
+  vector<size_t> offsets,counts;
+  //the ring, or qring when the window sets take 16-bit integers
+  vector<ESMBASE> ring;
+  vector<uint16_t> qring;
+  //where the column of marker starts in the ring
+  size_t column( const size_t & marker ) const;
+  template<typename V>
+  void reserve( vector<V> & ring, const size_t & n );
+  //reads the markers of ws that are not cached into ring, and lays out all of them in slab
+  template<typename V>
+  void load( perm_files & files, window_set & ws, vector<V> & ring, vector<V> & slab, ThreadPool * pool );
+};
+
+/*
+  Hands out the window sets in order with their slabs read in.
+
+  With O.prefetch > 0, a dedicated I/O thread reads (and decompresses)
+  up to O.prefetch sets ahead of the one being worked on, so reading
+  from disk overlaps with the ESM calculations.  The slab buffers are
+  recycled, so memory use is O.prefetch+1 slabs.
+
+  With O.prefetch == 0, each set is read when it is asked for.
+
+  With O.stop > 0, only the first O.stopblock perms of a set are read
+  ahead, and read_perms reads further blocks on demand.
+
+  With more than one file, the files are read (and decompressed) at
+  the same time on a pool of up to O.nthreads threads of the reader's
+  own, each into its part of the slab.
+
+  As with a file that cannot be opened, an error reading the files
+  (such as a corrupt chunk) is reported and esmk exits with status 10.
+  An error on the I/O thread is reported by next, in place of the set
+  it happened in.
+*/
+class window_set_reader
+{
+public:
+  /*
+    pos are the positions of markers first, first+1, ... in the files.
+    The windows are those with left boundaries first_left,
+    first_left + O.jumpsize, ... up to last_left.  files, from
+    open_perm_files, are only used by this reader until it is
+    destroyed, and can then be given to the next one.
+  */
+  window_set_reader( const esm_options & O,
+		     perm_files & files,
+		     const vector<int> & pos,
+		     const size_t & first,
+		     const int & first_left,
+		     const int & last_left );
+  ~window_set_reader();
+  /*
+    Returns the next set, or nullptr if there are no more.
+    The set returned by the previous call is recycled.
+  */
+  window_set * next( void );
+  //Replaces the slab of ws, the set last returned by next, with perms firstperm ... firstperm+nperms-1
+  void read_perms( window_set & ws, const size_t & firstperm, const size_t & nperms );
+  //The number of perms used: all of those in the files, or the first O.nperms
+  size_t nperms( void ) const;
+  //Only valid once next has returned nullptr
+  const column_cache & cache_stats( void ) const;
+  //Seconds spent reading (and decompressing) perms so far
+  double read_seconds( void ) const;
+private:
+  const esm_options & O;
+  const vector<int> & pos;
+  const size_t first;
+  //pos is in increasing order
+  const bool sorted;
+  perm_files & files;
+  //the files are read by both the I/O thread and read_perms
+  mutable mutex files_lock;
+  size_t nperms_tot;
+  //see shared_dequantization_table; empty if the perms are read as ESMBASE
+  const vector<ESMBASE> table;
+  //under files_lock
+  double read_secs;
+  unique_ptr<ThreadPool> iopool;
+  vector<window_set> buffers;
+  BoundedQueue<window_set *> filled,empty;
+  column_cache cache;
+  window_set * current;
+  int left;
+  const int last_left;
+  thread io;
+  //an error on the I/O thread, which stops it, for next to report
+  exception_ptr error;
+  void prefetch( void );
+  bool advance( window_set & ws );
+  void read( window_set & ws );
+  void fail( const exception_ptr & e ) const;
+};
+
+/*
+  The markers of one chromosome, which are markers first ...
+  first+pos.size()-1 in the files.  Its results go straight to the
+  ResultWriter, window set by window set.
+*/
+struct chromosome
+{
+  string name;
+  size_t first;
+  vector<int> pos;
+  //the left boundaries of the first and last windows to run
+  int first_left,last_left;
+  //process info for --verbose
+  size_t obs_values,obs_windows,perms_read,perms_all,cache_hits,cache_misses,nresults,perms_used;
+  double read_secs;
+  chromosome( void ) : first(0),first_left(1),last_left(numeric_limits<int>::max()),
+		       obs_values(0),obs_windows(0),perms_read(0),
+		       perms_all(0),cache_hits(0),cache_misses(0),nresults(0),perms_used(0),
+		       read_secs(0.) {}
+};
+
+/*
+  Keeps only the windows of shard O.shard_i of O.shard_n.  The windows
+  of all chromosomes, in file order, are cut into O.shard_n contiguous
+  runs with about the same number of markers (counting a marker once
+  for every window it is in), so every shard has about the same amount
+  of work, and the shards' outputs, one after the other, are the output
+  of the whole run.  Chromosomes with no windows in the shard are removed.
+*/
+void select_shard( const esm_options & O, vector<chromosome> & chroms );
+
+/*
+  Joins the outputs of --shard runs, O.infiles in shard order, into
+  O.outfile, which is then the same as the output of a single run.
+  The inputs can be in any of the output formats.
+*/
+void merge_shards( const esm_options & O );
+
+/*
+  Runs the test on the windows of one chromosome, reading files, with
+  the window calculations done on pool.  Each window set's results are
+  written to out as chromosome c, and logged to ck.
+*/
+void run_chromosome( const esm_options & O,
+		     const vector<ESMBASE> & chisq_obs,
+		     const LDmatrix & myld,
+		     perm_files & files,
+		     chromosome & C,
+		     ThreadPool & pool,
+		     Checkpoint & ck,
+		     ResultWriter & out,
+		     const size_t & c );
+
 void run_test( const esm_options & O );
 
 int main( int argc, char ** argv )
 {
   esm_options O = parseargs(argc,argv); 
-  if( !permfilesOK(O) )
+  if( O.merge )
     {
-      cerr << "Error with permutation files\n";
+      merge_shards(O);
+      exit(0);
+    }
+  try
+    {
+      if( !permfilesOK(O) )
+	{
+	  cerr << "Error with permutation files\n";
+	  exit(10);
+	}
+      run_test(O);
+    }
+  catch( const exception & e )
+    {
+      cerr << "Error: " << e.what() << '\n';
       exit(10);
     }
-  run_test(O);
 
   exit(0);
 }
@@ -109,15 +458,28 @@ esm_options parseargs( int argc, char ** argv )
   options_description desc("Calculate ESM_K p-values in sliding window");
   desc.add_options()
     ("help,h", "Produce help message")
-    ("outfile,o",value<string>(&rv.outfile),"Output file name.  Format is gzipped")
+    ("outfile,o",value<string>(&rv.outfile),"Output file name.  Rows are written as each window set finishes.  The format is gzipped text if the name ends in .gz, HDF5 columns if it ends in .h5, and plain text otherwise; see --format")
+    ("format",value<string>(&rv.format),"Output format: text, gz (gzipped text) or h5 (HDF5, with one dataset per column: /chr, /p.values, /loci.midpoint and, with --stop, /perms.used).  Default is set by the --outfile name")
     ("winsize,w",value<int>(&rv.winsize),"Window size (bp)")
     ("jumpsize,j",value<int>(&rv.jumpsize),"Window jump size (bp)")
     ("K,k",value<int>(&rv.K),"Number of markers to use for ESM_k stat in a window.  Must be > 0.")
     ("nwindows,n",value<int> (&rv.nwindows),"Number of windows to bring in at a time")
+    ("prefetch",value<unsigned>(&rv.prefetch)->default_value(1),"Number of window sets to read ahead on a separate I/O thread while the current set is computed.  0 = read each set when needed.  Default = 1")
+    ("threads,t",value<unsigned>(&rv.nthreads)->default_value(max(thread::hardware_concurrency(),1u)),"Number of worker threads, default = number of cores")
+    ("chroms",value<unsigned>(&rv.nchroms)->default_value(2),"Number of chromosomes to run at once, sharing the worker threads.  Largest chromosomes go first.  Default = 2")
     ("LDcutoff,r",value<ESMBASE> (&rv.LDcutoff), "The R^2 cutoff for LD between SNPs")
     ("cmarkers,m",value<size_t>(&rv.cmarkers)->default_value(50),"Raw data chunk size in markers, default = 50")
     ("cperms,c",value<size_t>(&rv.cperms)->default_value(10000),"Raw data chunk size in perms, default = 10000")
-    ("nperms,p",value<size_t>(&rv.nperms)->default_value(2000000),"Number of perms, default = 2000000")
+    ("nperms,p",value<size_t>(&rv.nperms)->default_value(0),"Use only the first nperms perms, counting through the files in the order given.  0 = use all of them.  Default = 0")
+    ("stop",value<size_t>(&rv.stop)->default_value(0),"Sequential stopping (Besag & Clifford 1991): stop evaluating a window's perms once this many have an ESM >= the observed one, and report p = stop/(perms used).  0 = always use every perm.  Default = 0")
+    ("stopblock",value<size_t>(&rv.stopblock)->default_value(10000),"Number of perms read in at a time with --stop, default = 10000")
+    ("shard",value<string>(),"Run only shard i/N of the windows, for i = 1 to N.  Each shard is a contiguous run of windows with about the same number of markers, and only reads the permutations of its own markers.  Join the outputs with --merge")
+    ("merge","Join the outputs of --shard runs, given in shard order in place of the permutation files, into --outfile")
+    ("resume","Carry on from the checkpoint left by an earlier run with the same options that did not finish.  The checkpoint is OUTFILE.checkpoint, which is updated after every window set and deleted when the run finishes")
+    ("incremental","Carry each permutation's top markers from one window to the next instead of starting over for each window.  Best with large --nwindows")
+    ("nocache","Do not keep permutation data for markers shared by consecutive window sets.  Default is to keep them and only read new markers, at the cost of one more copy of a window set's perms (all perms by its markers) besides the slabs")
+    ("verbose,v","Write process info to STDERR")
+    ("kernel",value<string>(&rv.kernel)->default_value("auto"),"ESM kernel: auto, scalar, avx2 or avx512.  Default = auto (widest supported by the CPU)")
     ;
 
   variables_map vm;
@@ -138,12 +500,44 @@ esm_options parseargs( int argc, char ** argv )
       exit(0);
     }
 
-  if (!vm.count("outfile") || !vm.count("winsize") || !vm.count("jumpsize") || !vm.count("K") || !vm.count("nwindows"))
+  rv.merge = vm.count("merge");
+  rv.resume = vm.count("resume");
+  if (!vm.count("outfile") || (!rv.merge && (!vm.count("winsize") || !vm.count("jumpsize") || !vm.count("K") || !vm.count("nwindows"))))
     {
       cerr << "Too few options given.\n"
 	   << desc << '\n';
       exit(10);
     }
+  rv.shard_i = rv.shard_n = 1;
+  if( vm.count("shard") )
+    {
+      const string & shard = vm["shard"].as<string>();
+      char slash = 0, extra = 0;
+      if( sscanf(shard.c_str(),"%u %c %u %c",&rv.shard_i,&slash,&rv.shard_n,&extra) != 3 || slash != '/' ||
+	  rv.shard_n == 0 || rv.shard_i == 0 || rv.shard_i > rv.shard_n )
+	{
+	  cerr << "Error: --shard must be i/N with 1 <= i <= N, not " << shard << ".\n";
+	  exit(10);
+	}
+    }
+  rv.incremental = vm.count("incremental");
+  rv.nocache = vm.count("nocache");
+  rv.verbose = vm.count("verbose");
+  if( rv.stop > 0 && rv.incremental )
+    {
+      cerr << "Error: --stop cannot be used with --incremental.\n";
+      exit(10);
+    }
+  if( rv.stopblock == 0 )
+    {
+      cerr << "Error: --stopblock must be > 0.\n";
+      exit(10);
+    }
+  if( !set_esm_kernel(rv.kernel) )
+    {
+      cerr << "Error: ESM kernel " << rv.kernel << " is unknown or not supported on this CPU.\n";
+      exit(10);
+    }
   rv.infiles = collect_unrecognized(parsed.options, include_positional);
   if(rv.infiles.empty())
     {
@@ -162,9 +556,7 @@ bool permfilesOK( const esm_options & O )
 
   vector<string> chroms_0 = read_strings(O.infiles[0].c_str(),"/Markers/chr");
  
-  set<string> sc_0(chroms_0.begin(),chroms_0.end());
-  
-  if( sc_0.size() > 1 ) { return false; }
+  //files may hold any number of chromosomes; run_test splits them up
  
   vector<string> markers_0 = read_strings(O.infiles[0].c_str(),"/Markers/IDs");
   vector<int> pos_0 = read_ints(O.infiles[0].c_str(),"/Markers/pos");  
@@ -174,8 +566,6 @@ bool permfilesOK( const esm_options & O )
   for ( size_t i = 1 ; i < O.infiles.size() ; ++i )
     {
       vector<string> chroms_i = read_strings(O.infiles[i].c_str(),"/Markers/chr");
-      set<string> sc_i(chroms_i.begin(),chroms_i.end());
-      if( sc_i.size() > 1 ) { return false; }
       vector<string> markers_i = read_strings(O.infiles[i].c_str(),"/Markers/IDs");
       vector<int> pos_i = read_ints(O.infiles[i].c_str(),"/Markers/pos");
       vector<string> snpA_i = read_strings(O.infiles[i].c_str(),"/LD/snpA");
@@ -185,7 +575,7 @@ if( markers_0 != markers_i)
 	  cerr <<"markers are not equal"<<"\n";
 	  return false;
 	}
- if(  sc_0 != sc_i )
+ if(  chroms_0 != chroms_i )
 	{
 	  cerr <<"chroms are not equal"<<"\n";
 	  return false;
@@ -206,7 +596,7 @@ if( markers_0 != markers_i)
 	  return false;
 	}  
       
-      if( markers_0 != markers_i || sc_0 != sc_i || pos_0 != pos_i || snpA_0 != snpA_i || snpB_0 != snpB_i)
+      if( markers_0 != markers_i || chroms_0 != chroms_i || pos_0 != pos_i || snpA_0 != snpA_i || snpB_0 != snpB_i)
 	{
 	  cerr <<"things are not equal"<<"\n";
 	  return false;
@@ -218,8 +608,21 @@ if( markers_0 != markers_i)
 
 pair<size_t,size_t> get_indexes( const vector<int> & pos,
 				 const int & left,
-				 const int & right )
+				 const int & right,
+				 const bool & sorted )
 {
+  if( sorted )
+    {
+      vector<int>::const_iterator ci1 = lower_bound(pos.begin(),pos.end(),left),
+	ci2 = upper_bound(ci1,pos.end(),right);
+      if( ci1 == ci2 )
+	{
+	  //no snps are in window
+	  return make_pair( numeric_limits<size_t>::max(),
+			    numeric_limits<size_t>::max() );
+	}
+      return make_pair( ci1-pos.begin(), ci2-pos.begin()-1 );
+    }
   vector<int>::const_iterator ci1 = find_if(pos.begin(),pos.end(),
 					    boost::bind( within(),_1,left,right));
   vector<int>::const_reverse_iterator ci2 = find_if(pos.rbegin(),pos.rend(),
@@ -234,59 +637,669 @@ pair<size_t,size_t> get_indexes( const vector<int> & pos,
   return make_pair( ci1-pos.begin(), pos.rend()-ci2-1 );
 }
 
-void calc_esm( const vector<ESMBASE> * data,
+size_t view_exceedances( const window_set & ws,
+			 const size_t & at,
+			 const size_t & nperms,
+			 const int & nmarkers,
+			 const size_t & stride,
+			 const short * keep,
+			 const vector<ESMBASE> & offsets,
+			 const ESMBASE & ESM_obs )
+{
+  if( ws.table != nullptr )
+    {
+      return esm_exceedances(&ws.qslab[at],ws.table,nperms,nmarkers,stride,keep,offsets,ESM_obs);
+    }
+  return esm_exceedances(&ws.slab[at],nperms,nmarkers,stride,keep,offsets,ESM_obs);
+}
+
+void calc_esm( const window_set * ws,
+	       const window_view & view,
 	       const ESMBASE & ESM_obs,
 	       const size_t & nperms,
-	       const int & nmarkers,
 	       const int & K,
 	       ESMBASE * ESMP_win,
 	       const vector<short> & keep_markers_win)
 {
-	      //for each perm in the data
-  vector<ESMBASE> ESM_perm ( nperms );
-  for ( size_t j = 0; j< nperms; ++j)
-    {
+  /*calculate the ESM for each perm in the data
+    Which is:
     
-      ESMBASE ESM = 0;
-      /*calculate the ESM
-	Which is:
-		    
-	ESM = SUM_k_M(Y_k + log10(k/M))
-	
-	where Y_k is the kth most significant chisq value and M is the number
-	of markers considered.
-      */  
-	     	   
-      // need to go from 0 to min(markers_used, nmarkers)
-      vector<ESMBASE> temp;
-      for ( int k =0 ; k < nmarkers ; ++k)
-	{
-	  temp.push_back((*data)[nmarkers*j + k]*keep_markers_win[k]);
-	}
-      //sort the markers for this range ( this sorts in ascending order)
-      sort( temp.begin(),temp.end(),boost::bind(greater<ESMBASE>(),_1,_2));
-      for ( int k =0 ; k < min(K,nmarkers) ; ++k )
-	{
-	  ESM += temp[k] + log10(((ESMBASE) k + 1) / (ESMBASE) nmarkers);
-	}
-		  
-      ESM_perm[j] = ESM;
-      
-    } 
-    ESMBASE PVAL_win = 0 ;
-    for ( size_t i = 0; i < ESM_perm.size(); ++i)//for each perm
+    ESM = SUM_k_M(Y_k + log10(k/M))
+    
+    where Y_k is the kth most significant chisq value and M is the number
+    of markers considered.
+
+    The log10(k/M) terms are the same for every perm, and only the
+    top min(K,M) values of each perm are needed, so see ESMkernel.hpp
+    for how this avoids a full sort of each perm.
+  */
+  const int nmarkers = int(view.width);
+  vector<ESMBASE> offsets = esm_offsets(nmarkers,K);
+  size_t nexceed = view_exceedances(*ws,view.offset,nperms,nmarkers,view.stride,&keep_markers_win[0],offsets,ESM_obs);
+  //divide by number of perms
+  *ESMP_win = (ESMBASE)nexceed/(ESMBASE)nperms;
+}
+
+void calc_esm_sequential( const window_set * ws,
+			  const window_view & view,
+			  const ESMBASE & ESM_obs,
+			  const size_t & nperms,
+			  const int & K,
+			  const vector<short> & keep_markers_win,
+			  const size_t & stop,
+			  size_t * nexceed,
+			  size_t * used )
+{
+  const int nmarkers = int(view.width);
+  vector<ESMBASE> offsets = esm_offsets(nmarkers,K);
+  size_t n = view_exceedances(*ws,view.offset,nperms,nmarkers,view.stride,&keep_markers_win[0],offsets,ESM_obs);
+  if( *nexceed + n < stop )
+    {
+      *nexceed += n;
+      *used += nperms;
+      return;
+    }
+  //the block reaches stop, so go back over it one perm at a time to find where
+  for ( size_t j = 0 ; j < nperms && *nexceed < stop ; ++j )
+    {
+      *nexceed += view_exceedances(*ws,view.offset + view.stride*j,1,nmarkers,view.stride,&keep_markers_win[0],offsets,ESM_obs);
+      ++*used;
+    }
+}
+
+void calc_esm_scan( const window_set * ws,
+		    const size_t & nmarkers_set,
+		    const size_t & firstperm,
+		    const size_t & nperms,
+		    const vector< pair<size_t,size_t> > * windows,
+		    const vector< vector<short> > * keep,
+		    const vector< vector<ESMBASE> > * offsets,
+		    const vector<ESMBASE> * ESM_obs,
+		    vector<size_t> * nexceed )
+{
+  if( nperms == 0 ) { return; }
+  if( ws->table != nullptr )
+    {
+      esm_scan_exceedances(&ws->qslab[nmarkers_set*firstperm],ws->table,nmarkers_set,nperms,
+			   *windows,*keep,*offsets,*ESM_obs,*nexceed);
+      return;
+    }
+  esm_scan_exceedances(&ws->slab[nmarkers_set*firstperm],nmarkers_set,nperms,
+		       *windows,*keep,*offsets,*ESM_obs,*nexceed);
+}
+
+bool next_window_set( const esm_options & O,
+		      const vector<int> & pos,
+		      const bool & sorted,
+		      const int & last_left,
+		      int & left,
+		      window_set & ws )
+{
+  const int LPOS = *(pos.end()-1); //This is the last position in pos
+  //While there is at least one valid window in the set
+  while( (LPOS - left)>= O.winsize && left <= last_left )
+    {
+      //the set stops short at last_left, so no markers past its last window are read
+      int nwin = min(O.nwindows,(last_left-left)/O.jumpsize + 1);
+      int right = left + O.winsize + O.jumpsize*(nwin-1);
+      //get the indexes in pos corresponding to left- and right- most SNPs in in the set of windows
+      ws.left = left;
+      ws.indexes = get_indexes(pos,left,right,sorted);
+      //jump forward to the next set of windows
+      left += O.jumpsize*O.nwindows;
+      if( ws.indexes.first != numeric_limits<size_t>::max() ) //If there are SNPs in the window set 
+	{
+	  return true;
+	}
+    }
+  return false;
+}
+
+void for_each_file( const perm_files & files,
+		    ThreadPool * pool,
+		    const function<void(const size_t &)> & read )
+{
+  if( pool == nullptr || files.size() < 2 )
+    {
+      for( size_t i = 0 ; i < files.size() ; ++i )
+	{
+	  read(i);
+	}
+      return;
+    }
+  mutex m;
+  exception_ptr error;
+  for( size_t i = 0 ; i < files.size() ; ++i )
+    {
+      pool->submit( [&read,&m,&error,i]() {
+	  try
+	    {
+	      read(i);
+	    }
+	  catch( ... )
+	    {
+	      lock_guard<mutex> lock(m);
+	      if( !error ) { error = current_exception(); }
+	    }
+	} );
+    }
+  pool->wait();
+  if( error )
+    {
+      rethrow_exception(error);
+    }
+}
+
+void read_window_set( perm_files & files,
+		      window_set & ws,
+		      const size_t & firstperm,
+		      const size_t & nperms,
+		      ThreadPool * pool )
+{
+  const size_t nmarkers_set = (ws.indexes.second - ws.indexes.first + 1);
+  ws.firstperm = firstperm;
+  ws.nperms = nperms;
+  if( ws.table != nullptr )
+    {
+      ws.qslab.resize(nperms*nmarkers_set);
+    }
+  else
+    {
+      ws.slab.resize(nperms*nmarkers_set);
+    }
+  //the files follow one another in perm order, so each one's perms go after the last one's
+  vector<size_t> from(files.size(),0), n(files.size(),0), row(files.size(),0);
+  size_t file_first = 0, done = 0;
+  for( size_t i = 0 ; i < files.size() && done < nperms ; ++i ) 
+    {
+      const size_t np_i = files[i]->nperms();
+      if( firstperm + done < file_first + np_i )
+	{
+	  from[i] = firstperm + done - file_first;
+	  n[i] = min( np_i - from[i], nperms - done );
+	  row[i] = done;
+	  done += n[i];
+	}
+      file_first += np_i;
+    }
+  for_each_file( files, pool, [&](const size_t & i) {
+      if( ws.table != nullptr )
+	{
+	  files[i]->read_slab(ws.indexes.first,nmarkers_set,from[i],n[i],&ws.qslab[row[i]*nmarkers_set]);
+	}
+      else
+	{
+	  files[i]->read_slab(ws.indexes.first,nmarkers_set,from[i],n[i],&ws.slab[row[i]*nmarkers_set]);
+	}
+    } );
+}
+
+column_cache::column_cache( void ) : hits(0),
+				     misses(0),
+				     first(0),
+				     ncols(0),
+				     capacity(0),
+				     stride(0),
+				     offsets(),
+				     counts(),
+				     ring(),
+				     qring()
+{
+}
+
+size_t column_cache::column( const size_t & marker ) const
+{
+  return (marker % capacity)*stride;
+}
+
+template<typename V>
+void column_cache::reserve( vector<V> & ring, const size_t & n )
+{
+  if( n <= capacity ) { return; }
+  //move the cached columns to their slots in the bigger ring
+  vector<V> bigger(n*stride);
+  for( size_t m = first ; m < first + ncols ; ++m )
+    {
+      const V * col = &ring[column(m)];
+      copy( col, col + stride, &bigger[(m % n)*stride] );
+    }
+  ring.swap(bigger);
+  capacity = n;
+}
+
+void column_cache::fill( perm_files & files, const size_t & nperms, window_set & ws, ThreadPool * pool )
+{
+  const size_t a = ws.indexes.first, b = ws.indexes.second;
+  //Sets move left to right, so anything else means starting over
+  if( ncols > 0 && ( a < first || a >= first + ncols || b + 1 < first + ncols ) )
+    {
+      ncols = 0;
+    }
+  if( ncols == 0 )
+    {
+      first = a;
+    }
+  //drop what falls off the left
+  ncols -= (a - first);
+  first = a;
+  hits += ncols;
+
+  if( stride == 0 )
+    {
+      for( size_t i = 0 ; i < files.size() ; ++i )
+	{
+	  offsets.push_back(stride);
+	  counts.push_back(min(files[i]->nperms(),nperms - stride));
+	  stride += counts.back();
+	}
+    }
+  ws.firstperm = 0;
+  ws.nperms = stride;
+  if( ws.table != nullptr )
+    {
+      load( files, ws, qring, ws.qslab, pool );
+    }
+  else
+    {
+      load( files, ws, ring, ws.slab, pool );
+    }
+}
+
+template<typename V>
+void column_cache::load( perm_files & files, window_set & ws, vector<V> & ring, vector<V> & slab, ThreadPool * pool )
+{
+  const size_t a = ws.indexes.first, b = ws.indexes.second;
+  const size_t nmarkers_set = b - a + 1;
+  reserve( ring, nmarkers_set );
+
+  //read the markers to the right of what is cached, in runs that do not wrap around the ring
+  size_t m = first + ncols;
+  misses += b + 1 - m;
+  while( m <= b )
+    {
+      const size_t slot = m % capacity;
+      const size_t run = min( b - m + 1, capacity - slot );
+      for_each_file( files, pool, [&](const size_t & i) {
+	  files[i]->read_columns(m,run,0,counts[i],&ring[slot*stride + offsets[i]],stride);
+	} );
+      m += run;
+    }
+  ncols = nmarkers_set;
+
+  /*
+    Lay the columns out perm-major, the same as read_window_set.
+    The copy goes tile by tile, so that the tile's columns in the ring
+    and its rows in the slab stay in cache while it is transposed,
+    instead of striding through the whole slab once per column.
+  */
+  const size_t tile = 64;
+  slab.resize( stride*nmarkers_set );
+  for( size_t c0 = 0 ; c0 < nmarkers_set ; c0 += tile )
+    {
+      const size_t c1 = min( c0 + tile, nmarkers_set );
+      for( size_t j0 = 0 ; j0 < stride ; j0 += tile )
+	{
+	  const size_t j1 = min( j0 + tile, stride );
+	  for( size_t c = c0 ; c < c1 ; ++c )
+	    {
+	      const V * col = &ring[column(a + c)];
+	      for( size_t j = j0 ; j < j1 ; ++j )
+		{
+		  slab[j*nmarkers_set + c] = col[j];
+		}
+	    }
+	}
+    }
+}
+
+perm_files open_perm_files( const esm_options & O )
+{
+  perm_files files;
+  try
+    {
+      for( size_t i = 0 ; i < O.infiles.size() ; ++i )
+	{
+	  //a view written by h5merge --virtual is read from its files, so that they are read in parallel like any others
+	  vector<size_t> nrows;
+	  vector<string> sources = virtual_sources(O.infiles[i].c_str(),"/Perms/permutations",nrows);
+	  if( sources.empty() )
+	    {
+	      sources.push_back(O.infiles[i]);
+	    }
+	  for( size_t j = 0 ; j < sources.size() ; ++j )
+	    {
+	      files.push_back( unique_ptr<perm_reader>(new perm_reader(sources[j].c_str(),"/Perms/permutations",O.cmarkers,O.cperms)) );
+	      if( !nrows.empty() && files.back()->nperms() != nrows[j] )
+		{
+		  throw runtime_error( sources[j] + " does not have the " + to_string(nrows[j]) + " perms that " +
+				       O.infiles[i] + " maps to it" );
+		}
+	    }
+	}
+    }
+  catch( const exception & e )
+    {
+      cerr << "Error: " << e.what() << '\n';
+      exit(10);
+    }
+  return files;
+}
+
+vector<ESMBASE> shared_dequantization_table( const perm_files & files )
+{
+  vector<ESMBASE> table;
+  for( size_t i = 0 ; i < files.size() ; ++i )
+    {
+      if( !files[i]->quantized() )
+	{
+	  return vector<ESMBASE>();
+	}
+      if( i == 0 )
+	{
+	  table = files[i]->dequantization_table();
+	}
+      else if( files[i]->dequantization_table() != table )
+	{
+	  return vector<ESMBASE>();
+	}
+    }
+  return table;
+}
+
+window_set_reader::window_set_reader( const esm_options & O_,
+				      perm_files & files_,
+				      const vector<int> & pos_,
+				      const size_t & first_,
+				      const int & first_left,
+				      const int & last_left_ ) : O(O_),
+								pos(pos_),
+								first(first_),
+								sorted(is_sorted(pos_.begin(),pos_.end())),
+								files(files_),
+								files_lock(),
+								nperms_tot(0),
+								table(shared_dequantization_table(files_)),
+								read_secs(0.),
+								iopool(),
+								buffers(O_.prefetch+1),
+								filled(O_.prefetch),
+								empty(O_.prefetch+1),
+								current(nullptr),
+								left(first_left),
+								last_left(last_left_),
+								io(),
+								error()
+{
+  for( size_t i = 0 ; i < files.size() ; ++i )
+    {
+      nperms_tot += files[i]->nperms();
+    }
+  if( O.nperms > 0 )
+    {
+      nperms_tot = min(nperms_tot,O.nperms);
+    }
+  if( files.size() > 1 && O.nthreads > 1 )
+    {
+      iopool.reset( new ThreadPool( unsigned(min(files.size(),size_t(O.nthreads))) ) );
+    }
+  if( O.prefetch > 0 )
+    {
+      for( size_t i = 0 ; i < buffers.size() ; ++i )
+	{
+	  empty.push(&buffers[i]);
+	}
+      io = thread(&window_set_reader::prefetch,this);
+    }
+}
+
+window_set_reader::~window_set_reader()
+{
+  if( io.joinable() )
     {
-      if (ESM_perm[i]>=ESM_obs)//if the ESM is larger than observed
+      filled.close();
+      empty.close();
+      io.join();
+    }
+}
+
+void window_set_reader::prefetch( void )
+{
+  window_set * ws;
+  while( empty.pop(ws) )
+    {
+      if( !advance(*ws) )
+	{
+	  break;
+	}
+      try
+	{
+	  read(*ws);
+	}
+      catch( ... )
 	{
-	  PVAL_win += 1 ;
+	  error = current_exception();
+	  break;
 	}
+      if( !filled.push(ws) )
+	{
+	  break;
+	}
+    }
+  filled.close();
+}
+
+//next_window_set, with the set's markers counted from the start of the files
+bool window_set_reader::advance( window_set & ws )
+{
+  if( !next_window_set(O,pos,sorted,last_left,left,ws) )
+    {
+      return false;
+    }
+  ws.indexes.first += first;
+  ws.indexes.second += first;
+  return true;
+}
+
+void window_set_reader::read( window_set & ws )
+{
+  lock_guard<mutex> lock(files_lock);
+  const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  ws.table = table.empty() ? nullptr : table.data();
+  if( O.stop > 0 )
+    {
+      //the column cache holds every perm of a marker, so it is not used here
+      read_window_set(files,ws,0,min(nperms_tot,O.stopblock),iopool.get());
+    }
+  else if( O.nocache )
+    {
+      read_window_set(files,ws,0,nperms_tot,iopool.get());
+    }
+  else
+    {
+      cache.fill(files,nperms_tot,ws,iopool.get());
     }
-    PVAL_win /= (ESMBASE)ESM_perm.size();//divide by number of perms
-    *ESMP_win = PVAL_win;
+  read_secs += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
 
+void window_set_reader::read_perms( window_set & ws,
+				    const size_t & firstperm,
+				    const size_t & nperms )
+{
+  lock_guard<mutex> lock(files_lock);
+  const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  try
+    {
+      read_window_set(files,ws,firstperm,nperms,iopool.get());
+    }
+  catch( ... )
+    {
+      fail(current_exception());
+    }
+  read_secs += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+size_t window_set_reader::nperms( void ) const
+{
+  return nperms_tot;
+}
+
+const column_cache & window_set_reader::cache_stats( void ) const
+{
+  return cache;
+}
+
+double window_set_reader::read_seconds( void ) const
+{
+  lock_guard<mutex> lock(files_lock);
+  return read_secs;
+}
+
+window_set * window_set_reader::next( void )
+{
+  if( O.prefetch == 0 )
+    {
+      if( !advance(buffers[0]) )
+	{
+	  return nullptr;
+	}
+      try
+	{
+	  read(buffers[0]);
+	}
+      catch( ... )
+	{
+	  fail(current_exception());
+	}
+      return &buffers[0];
+    }
+  if( current != nullptr )
+    {
+      empty.push(current);
+      current = nullptr;
+    }
+  if( !filled.pop(current) )
+    {
+      if( error )
+	{
+	  fail(error);
+	}
+      return nullptr;
+    }
+  return current;
+}
+
+void window_set_reader::fail( const exception_ptr & e ) const
+{
+  try
+    {
+      rethrow_exception(e);
+    }
+  catch( const exception & x )
+    {
+      cerr << "Error: " << x.what() << '\n';
+    }
+  catch( ... )
+    {
+      cerr << "Error: could not read the permutations\n";
+    }
+  exit(10);
+}
+
+void select_shard( const esm_options & O, vector<chromosome> & chroms )
+{
+  //the number of markers in each window of each chromosome
+  vector< vector<size_t> > weights(chroms.size());
+  unsigned long long total = 0;
+  for ( size_t c = 0 ; c < chroms.size() ; ++c )
+    {
+      const vector<int> & pos = chroms[c].pos;
+      const bool sorted = is_sorted(pos.begin(),pos.end());
+      const int LPOS = *(pos.end()-1);
+      for ( int left = 1 ; (LPOS - left) >= O.winsize ; left += O.jumpsize )
+	{
+	  pair<size_t,size_t> indexes = get_indexes(pos,left,left + O.winsize,sorted);
+	  size_t w = (indexes.first == numeric_limits<size_t>::max()) ? 0 : indexes.second - indexes.first + 1;
+	  weights[c].push_back(w);
+	  total += w;
+	}
+    }
+  //a window goes to the shard that the markers before it point to
+  vector<chromosome> kept;
+  unsigned long long before = 0;
+  for ( size_t c = 0 ; c < chroms.size() ; ++c )
+    {
+      long long first_w = -1, last_w = -1;
+      for ( size_t k = 0 ; k < weights[c].size() ; ++k )
+	{
+	  unsigned long long shard = (total > 0) ? min<unsigned long long>(O.shard_n-1,(O.shard_n*before)/total) : 0;
+	  if( shard + 1 == O.shard_i )
+	    {
+	      if( first_w < 0 ) { first_w = k; }
+	      last_w = k;
+	    }
+	  before += weights[c][k];
+	}
+      if( first_w >= 0 )
+	{
+	  chroms[c].first_left = 1 + int(first_w)*O.jumpsize;
+	  chroms[c].last_left = 1 + int(last_w)*O.jumpsize;
+	  kept.push_back( move(chroms[c]) );
+	}
+    }
+  chroms.swap(kept);
+}
+
+void merge_shards( const esm_options & O )
+{
+  string header,line;
+  bool with_used = false;
+  vector<string> chr;
+  vector<ESMBASE> p_values,midpoints;
+  vector<size_t> perms_used;
+  for ( size_t i = 0 ; i < O.infiles.size() ; ++i )
+    {
+      bool used_i;
+      if( !read_results(O.infiles[i],line,used_i,chr,p_values,midpoints,perms_used) )
+	{
+	  cerr << "Error: could not read " << O.infiles[i] << ".\n";
+	  exit(10);
+	}
+      if( i == 0 )
+	{
+	  header = line;
+	  with_used = used_i;
+	}
+      else if( line != header )
+	{
+	  cerr << "Error: " << O.infiles[i] << " does not have the same columns as " << O.infiles[0] << ".\n";
+	  exit(10);
+	}
+    }
+  //each run of rows with the same chr is written as one chromosome
+  vector<string> names;
+  vector<size_t> starts;
+  for ( size_t i = 0 ; i < chr.size() ; ++i )
+    {
+      if( i == 0 || chr[i] != chr[i-1] )
+	{
+	  names.push_back(chr[i]);
+	  starts.push_back(i);
+	}
+    }
+  starts.push_back(chr.size());
+  ResultWriter out(O.outfile,ResultWriter::pick_format(O.format,O.outfile),names,with_used);
+  for ( size_t c = 0 ; c < names.size() ; ++c )
+    {
+      out.write(c,&p_values[starts[c]],&midpoints[starts[c]],&perms_used[starts[c]],starts[c+1]-starts[c]);
+      out.finish(c);
+    }
+  if( !out.close() )
+    {
+      cerr << "Error: could not write " << O.outfile << ".\n";
+      exit(10);
+    }
 }
 
-				 
 void run_test( const esm_options & O )
 {
   //Step 1: read in the marker data from the first file in 0.infiles:
@@ -294,8 +1307,6 @@ void run_test( const esm_options & O )
   
   vector<string> chroms_0 = read_strings(O.infiles[0].c_str(),"/Markers/chr");
   
-  set<string> sc_0(chroms_0.begin(),chroms_0.end());
-  chroms_0.clear();
   //1b: the rsID for the markers
   
   vector<string> markers_0 = read_strings(O.infiles[0].c_str(),"/Markers/IDs");
@@ -314,188 +1325,430 @@ void run_test( const esm_options & O )
   vector<string>snpB = read_strings(O.infiles[0].c_str(),"/LD/snpB");
   vector<ESMBASE>rsq = read_doubles(O.infiles[0].c_str(),"/LD/rsq");
   
-  //LD map takes a pair of snps and returns an R squared value
-  typedef pair<string, string> snp_pair;
-  typedef map<snp_pair, ESMBASE> LDMap;
-
-  LDMap myld;
-  snp_pair snps;
-  
-  for (size_t i=0; i < snpA.size();++i)
+  //LD matrix takes a pair of marker indexes and returns an R squared value
+  LDmatrix myld(markers_0,snpA,snpB,rsq);
+  if( O.verbose )
     {
-      snps = make_pair(snpA[i],snpB[i]);
-      myld.insert(make_pair(snps,rsq[i])); 
+      cerr << "LD: " << myld.npairs() << " pairs of markers, "
+	   << double(myld.bytes())/(1024.*1024.) << " MB";
+      if( myld.ndropped() > 0 )
+	{
+	  cerr << " (" << myld.ndropped() << " pairs not used)";
+	}
+      cerr << '\n';
     }
+  snpA.clear(); snpA.shrink_to_fit();
+  snpB.clear(); snpB.shrink_to_fit();
+  rsq.clear(); rsq.shrink_to_fit();
+  markers_0.clear(); markers_0.shrink_to_fit();
   
-  
-  //Step 2: establish the left and right boundaries of the first set of windows
-  int left = 1, right = O.winsize  + O.jumpsize*(O.nwindows-1) + 1;
+  //Step 2: split the markers by chromosome; each one's markers must be together in the files
+  vector<chromosome> chroms;
+  for ( size_t i = 0 ; i < chroms_0.size() ; ++i )
+    {
+      if( chroms.empty() || chroms_0[i] != chroms.back().name )
+	{
+	  for ( size_t c = 0 ; c < chroms.size() ; ++c )
+	    {
+	      if( chroms[c].name == chroms_0[i] )
+		{
+		  cerr << "Error: the markers on chromosome " << chroms_0[i] << " are not all together in the permutation files.\n";
+		  exit(10);
+		}
+	    }
+	  chroms.push_back( chromosome() );
+	  chroms.back().name = chroms_0[i];
+	  chroms.back().first = i;
+	}
+      chroms.back().pos.push_back(pos_0[i]);
+    }
+  chroms_0.clear();
+  if( O.shard_n > 1 )
+    {
+      select_shard(O,chroms);
+    }
 
-  //Step 3: go over the current data and make sure that our helper functions are working
-  
-   const int LPOS = *(pos_0.end()-1); //This is the last position in pos_0.  Equivalent to pos[pos.size()-1], but I guess I like to complicate things.
-  
-  //declare vectors for the final PVALUES, the midpoint of associated window and chromosome(dumbway):
-  vector<ESMBASE> p_values;
-  vector<ESMBASE> midpoints;
+  /*
+    The checkpoint is named after the output, and its first line lists
+    the options that make a difference to the results.
+  */
+  ostringstream run;
+  run.precision(numeric_limits<ESMBASE>::max_digits10);
+  run << "esmk checkpoint -w " << O.winsize << " -j " << O.jumpsize << " -k " << O.K << " -n " << O.nwindows
+      << " -r " << O.LDcutoff << " -p " << O.nperms << " --stop " << O.stop << " --stopblock " << O.stopblock
+      << " --shard " << O.shard_i << '/' << O.shard_n;
+  for ( size_t i = 0 ; i < O.infiles.size() ; ++i )
+    {
+      run << ' ' << O.infiles[i];
+    }
+  Checkpoint ck(O.outfile + ".checkpoint",run.str(),O.resume);
 
-  
-  //While there is at least one valid window in the set
-  while( (LPOS - left)>= O.winsize )
+  //the results, in the order the chromosomes are in the files
+  vector<string> names;
+  for ( size_t c = 0 ; c < chroms.size() ; ++c )
     {
-      //get the indexes in pos_0 corresponding to left- and right- most SNPs in in the set of windows
-      pair<size_t,size_t> indexes_set = get_indexes(pos_0,left,right);
-      size_t nmarkers_set = (indexes_set.second - indexes_set.first + 1);
-      
-      if( indexes_set.first != numeric_limits<size_t>::max() ) //If there are SNPs in the window set 
-	{
-	  //the set is either full with n = O.nwindows or it is smaller
-	  // such that LPOS is the real right endpoint and 
-	  int nwin_set = min(O.nwindows,( ((LPOS-left)-O.winsize)/O.jumpsize) + 1);
-	  vector< pair<size_t,size_t> > indexes_win;
-	  vector<size_t> nmarkers_win;
-	  vector<size_t> loci_mid;
-	  for ( int m = 0 ; m < nwin_set; ++m )
-	    {      
-	      size_t nmarkers_set = (indexes_set.second - indexes_set.first + 1);
-	      int izqui = left + m*O.jumpsize  ;
-	      int derech = izqui + O.winsize;
-	      indexes_win.push_back(get_indexes(pos_0,izqui, derech));
-	      nmarkers_win.push_back(indexes_win[m].second - indexes_win[m].first + 1);
-	      loci_mid.push_back( (derech + izqui)/2 );
-	    }
+      names.push_back(chroms[c].name);
+    }
+  ResultWriter out(O.outfile,ResultWriter::pick_format(O.format,O.outfile),names,O.stop > 0);
+  for ( size_t c = 0 ; c < chroms.size() ; ++c )
+    {
+      //windows that were finished before are written out again, not run again
+      const Checkpoint::progress * P = ck.resumed(chroms[c].name);
+      if( P != nullptr )
+	{
+	  out.write(c,P->p_values.data(),P->midpoints.data(),P->perms_used.data(),P->p_values.size());
+	  chroms[c].first_left = max(chroms[c].first_left,P->next_left);
+	}
+    }
 
-	  vector<ESMBASE> ESMP_win ( nwin_set ) ;
-	  vector<ESMBASE> ESM_obs_win ( nwin_set );
-	  vector<ESMBASE> newdata  ;   
-	  size_t markers_used = O.K;
+  /*
+    Step 3: run the chromosomes, O.nchroms at a time, largest first so
+    that the last ones to finish are short.  Each has its own reader and
+    submits its windows to the one pool of workers.  The permutation
+    files are opened once for each of the O.nchroms drivers, whose
+    chromosomes' readers take turns with them.
+  */
+  vector<size_t> order(chroms.size());
+  iota(order.begin(),order.end(),0);
+  stable_sort(order.begin(),order.end(),
+	      [&chroms](const size_t & a, const size_t & b){ return chroms[a].pos.size() > chroms[b].pos.size(); });
+  ThreadPool pool(O.nthreads);
+  const size_t ndrivers = max(min(size_t(O.nchroms),chroms.size()),size_t(1));
+  vector<perm_files> files(ndrivers);
+  for ( size_t d = 0 ; d < ndrivers ; ++d )
+    {
+      files[d] = open_perm_files(O);
+    }
+  atomic<size_t> next_chrom(0);
+  auto run_chromosomes = [&](const size_t d) {
+    size_t c;
+    while( (c = next_chrom++) < order.size() )
+      {
+	run_chromosome(O,chisq_obs,myld,files[d],chroms[order[c]],pool,ck,out,order[c]);
+	out.finish(order[c]);
+      }
+  };
+  vector<thread> drivers;
+  for ( size_t d = 1 ; d < ndrivers ; ++d )
+    {
+      drivers.push_back( thread(run_chromosomes,d) );
+    }
+  run_chromosomes(0);
+  for ( size_t d = 0 ; d < drivers.size() ; ++d )
+    {
+      drivers[d].join();
+    }
 
-      	 	 
-	  for( size_t i = 0 ; i < O.infiles.size() ; ++i ) 
+  if( O.verbose )
+    {
+      size_t obs_values = 0, obs_windows = 0, perms_read = 0, perms_all = 0, hits = 0, misses = 0, nwin = 0;
+      double used = 0, read_secs = 0;
+      for ( size_t c = 0 ; c < chroms.size() ; ++c )
+	{
+	  read_secs += chroms[c].read_secs;
+	  obs_values += chroms[c].obs_values;
+	  obs_windows += chroms[c].obs_windows;
+	  perms_read += chroms[c].perms_read;
+	  perms_all += chroms[c].perms_all;
+	  hits += chroms[c].cache_hits;
+	  misses += chroms[c].cache_misses;
+	  used += chroms[c].perms_used;
+	  nwin += chroms[c].nresults;
+	}
+      if( O.shard_n > 1 )
+	{
+	  cerr << "Shard " << O.shard_i << '/' << O.shard_n << ":";
+	  for ( size_t c = 0 ; c < chroms.size() ; ++c )
 	    {
-	      //Get a the slab in vector form from the file
-	      vector<ESMBASE> fresh = read_doubles_slab(O.infiles[i].c_str(),"/Perms/permutations",indexes_set.first, nmarkers_set,O.cmarkers,O.cperms,O.nperms) ;
-	      for ( size_t b = 0; b< fresh.size(); ++b)
-		{
-		  newdata.push_back(fresh[b]);
-		}
+	      cerr << " chr " << chroms[c].name << " windows " << chroms[c].first_left << '-' << chroms[c].last_left << ';';
 	    }
-	  //this should be the same, but may as well determine it here
-	  size_t nperms_tot = newdata.size()/nmarkers_set;
-	  
-	  //prepare the vector of esm values  for the new values from the file
-	  //we have one ESM value for each perm
-	  //vector of vectors to contain data for all perms in each window
-	  vector< vector<ESMBASE> > data ( nwin_set );
-	  vector< vector<short> > keep_markers_win ( nwin_set );
-	  for ( int m = 0 ; m < nwin_set; ++m)
+	  cerr << '\n';
+	}
+      if( O.resume )
+	{
+	  cerr << "Resumed: " << ck.nresumed() << " windows were done already\n";
+	}
+      cerr << "Chromosomes: " << chroms.size() << ", run " << min(size_t(O.nchroms),chroms.size()) << " at a time\n";
+      cerr << "Observed statistics: " << obs_windows << " windows, "
+	   << (obs_windows > 0 ? double(obs_values)/double(obs_windows) : 0.)
+	   << " values copied per window (" << chisq_obs.size() << " markers in total)\n";
+      if( !shared_dequantization_table(files[0]).empty() )
+	{
+	  cerr << "Perms are quantized, and kept in memory as the 16-bit integers stored\n";
+	}
+      cerr << "Perms read and decompressed in " << read_secs << " s";
+      if( O.prefetch > 0 )
+	{
+	  cerr << " (overlapping the ESM calculations)";
+	}
+      cerr << '\n';
+      if( O.stop > 0 )
+	{
+	  cerr << "Sequential stopping: " << used/max(double(nwin),1.)
+	       << " perms used per window on average; "
+	       << (perms_all > 0 ? 100.*double(perms_read)/double(perms_all) : 0.) << "% of the perms were read\n";
+	}
+      if( !O.nocache && O.stop == 0 )
+	{
+	  cerr << "Column cache: " << hits << " hits, " << misses << " misses ("
+	       << (hits+misses > 0 ? 100.*double(hits)/double(hits+misses) : 0.)
+	       << "% of marker columns reused)\n";
+	}
+    }
+
+  if( !out.close() )
+    {
+      cerr << "Error: could not write " << O.outfile << "; the checkpoint is kept.\n";
+      exit(10);
+    }
+  ck.remove();
+}
+
+void run_chromosome( const esm_options & O,
+		     const vector<ESMBASE> & chisq_obs,
+		     const LDmatrix & myld,
+		     perm_files & files,
+		     chromosome & C,
+		     ThreadPool & pool,
+		     Checkpoint & ck,
+		     ResultWriter & out,
+		     const size_t & c )
+{
+  //window sets are read in order, possibly ahead of time on an I/O thread
+  window_set_reader reader(O,files,C.pos,C.first,C.first_left,C.last_left);
+  window_set * ws;
+  const bool pos_sorted = is_sorted(C.pos.begin(),C.pos.end());
+
+  const int LPOS = *(C.pos.end()-1); //This is the last position on the chromosome.  Equivalent to pos[pos.size()-1], but I guess I like to complicate things.
+
+  //this chromosome's windows (or ranges of perms) are queued as tasks on the shared workers
+  TaskGroup group(pool);
+
+  /*
+    Window-local buffers, reused from one window (and set) to the next,
+    so that the observed statistic only ever touches the window's own
+    markers and nothing is allocated once they have grown to size.
+  */
+  vector<ESMBASE> chisq_win;
+  vector< vector<short> > keep_markers_win;
+
+  //For each set of windows that has SNPs in it
+  while( (ws = reader.next()) != nullptr )
+    {
+      const int left = ws->left;
+      const pair<size_t,size_t> & indexes_set = ws->indexes;
+      size_t nmarkers_set = (indexes_set.second - indexes_set.first + 1);
+      //the set is either full with n = O.nwindows or it is smaller
+      // such that LPOS is the real right endpoint and
+      int nwin_set = min(O.nwindows,( ((LPOS-left)-O.winsize)/O.jumpsize) + 1);
+      //or it stops at the chromosome's last window for this shard
+      nwin_set = min(nwin_set,(C.last_left-left)/O.jumpsize + 1);
+      vector< pair<size_t,size_t> > indexes_win;
+      vector<size_t> nmarkers_win;
+      vector<size_t> loci_mid;
+      for ( int m = 0 ; m < nwin_set; ++m )
+	{
+	  size_t nmarkers_set = (indexes_set.second - indexes_set.first + 1);
+	  int izqui = left + m*O.jumpsize  ;
+	  int derech = izqui + O.winsize;
+	  indexes_win.push_back(get_indexes(C.pos,izqui, derech, pos_sorted));
+	  //from the chromosome's markers to the files' markers
+	  if( indexes_win[m].first != numeric_limits<size_t>::max() )
 	    {
-	      if( indexes_win[m].first != numeric_limits<size_t>::max() ){
-		//using the constructor to copy chisq_obs; probably the same as using equals, but I wasn't 100% sure
-		//used to reset the sorting that occurs
-		
-		vector<ESMBASE> chisq_win( chisq_obs ) ;
-		vector<string> markers_win ( markers_0 ) ;
-		vector<short> keep ( nmarkers_win[m], 1 );
-		keep_markers_win[m] = keep;
-		snp_pair AB;
-		ESMBASE LD_AB;
-		size_t a = 0;
-		//Go through markers in the window and filter by LD
-		//If two markers are in too much LD, then keep the one to the left, i.e. the first one
-		for (size_t q = indexes_win[m].first; q < indexes_win[m].first + nmarkers_win[m]-1;++q,++a)
+	      indexes_win[m].first += C.first;
+	      indexes_win[m].second += C.first;
+	    }
+	  nmarkers_win.push_back(indexes_win[m].second - indexes_win[m].first + 1);
+	  loci_mid.push_back( (derech + izqui)/2 );
+	}
+
+      vector<ESMBASE> ESMP_win ( nwin_set ) ;
+      vector<ESMBASE> ESM_obs_win ( nwin_set );
+      size_t markers_used = O.K;
+
+      //the perms in the set's slab, which is only the first block of them with O.stop > 0
+      size_t nperms_tot = ws->nperms;
+      //perms each window used, which is all of them unless it stopped early
+      vector<size_t> used_win ( nwin_set, O.stop > 0 ? 0 : nperms_tot );
+
+      //each window is a view into the set's slab; nothing is copied out of it
+      vector<window_view> views ( nwin_set );
+      if( keep_markers_win.size() < size_t(nwin_set) ) { keep_markers_win.resize(nwin_set); }
+      for ( int m = 0 ; m < nwin_set; ++m)
+	{
+	  if( indexes_win[m].first != numeric_limits<size_t>::max() ){
+	    const size_t first = indexes_win[m].first, last = indexes_win[m].second;
+	    //the window's own observed values; the LD filter and the sort below only change this copy
+	    chisq_win.assign( chisq_obs.begin() + first, chisq_obs.begin() + last + 1 );
+	    keep_markers_win[m].assign( nmarkers_win[m], 1 );
+	    C.obs_values += nmarkers_win[m];
+	    ++C.obs_windows;
+	    //Go through markers in the window and filter by LD
+	    //If two markers are in too much LD, then keep the one to the left, i.e. the first one
+	    if( !(ESMBASE(0) > O.LDcutoff) )
+	      {
+		//pairs with no LD value can't be over the cutoff, so only the stored pairs need looking at
+		for (size_t q = first; q < last; ++q)
 		  {
-		    size_t b = a + 1;
-		    for (size_t qq = q + 1; qq < indexes_win[m].first + nmarkers_win[m]; ++qq,++b)
+		    for (size_t i = myld.row_find(q,q+1); i < myld.row_end(q) && myld.column(i) <= last; ++i)
 		      {
-			if (keep_markers_win[m][b])
+			const size_t qq = myld.column(i);
+			if (keep_markers_win[m][qq-first] && myld.value(i) > O.LDcutoff)
 			  {
-			    snp_pair AB = make_pair(markers_0[q],markers_0[qq]);
-			    LD_AB = myld[AB];
-			    if (LD_AB >O.LDcutoff)
-			      {
-				
-				keep_markers_win[m][b] = 0;
-				
-				chisq_win[qq] = chisq_win[qq]*0;
-				
-			      }
+			    keep_markers_win[m][qq-first] = 0;
+			    chisq_win[qq-first] = chisq_win[qq-first]*0;
 			  }
-					
-		      }		    
-		  }
-		
-		sort( chisq_win.begin() + indexes_win[m].first, 
-		      chisq_win.begin() + indexes_win[m].second,
-		      boost::bind(greater<ESMBASE>(),_1,_2)
-		      );
-		
-		ESMBASE ESM_obs = 0;
-		size_t n;    
-		for ( size_t q = indexes_win[m].first; q < indexes_win[m].first + min(markers_used, nmarkers_win[m]); ++q )
-		  {
-		    
-		    n  = q - indexes_win[m].first + 1;
-		    //critical that the denominator be nmarkers in the window NOT markers_used
-		    ESM_obs += chisq_win[q] + log10((ESMBASE) n / (ESMBASE) nmarkers_win[m]);
-		      
+		      }
 		  }
-		
-		ESM_obs_win[m] = ESM_obs;
-		for ( size_t w = 0 ; w < nperms_tot; ++w )
+	      }
+	    else
+	      {
+		for (size_t q = first; q < last; ++q)
 		  {
-		    for ( size_t z = 0; z < nmarkers_win[m]; ++z )
-		      { 
-			//each element in data is a vector of p values collated by marker then perm
-			//THIS is where the problem is; you are moving forward by too much, you need to caluclate the number of markers
-			//that you skip during the jump.
-			data[m].push_back(newdata[w*nmarkers_set + indexes_win[m].first - indexes_set.first + z]) ;
+		    for (size_t qq = q + 1; qq <= last; ++qq)
+		      {
+			if (keep_markers_win[m][qq-first] && myld(q,qq) > O.LDcutoff)
+			  {
+			    keep_markers_win[m][qq-first] = 0;
+			    chisq_win[qq-first] = chisq_win[qq-first]*0;
+			  }
 		      }
 		  }
 	      }
-	    }//end for m in nwin set
-	  
-	  //ESTABLISH THREADS
-	  vector<thread> t ( nwin_set );
-	  
-	  
-	  for ( unsigned h = 0 ; h < t.size(); ++h)
+
+	    //as always, the last marker in the window is left out of the sort
+	    sort( chisq_win.begin(),
+		  chisq_win.end() - 1,
+		  boost::bind(greater<ESMBASE>(),_1,_2)
+		  );
+
+	    ESMBASE ESM_obs = 0;
+	    for ( size_t n = 1; n <= min(markers_used, nmarkers_win[m]); ++n )
+	      {
+		//critical that the denominator be nmarkers in the window NOT markers_used
+		ESM_obs += chisq_win[n-1] + log10((ESMBASE) n / (ESMBASE) nmarkers_win[m]);
+	      }
+
+	    ESM_obs_win[m] = ESM_obs;
+	    views[m].offset = indexes_win[m].first - indexes_set.first;
+	    views[m].stride = nmarkers_set;
+	    views[m].width = nmarkers_win[m];
+	  }
+	}//end for m in nwin set
+
+      if( O.incremental )
+	{
+	  /*
+	    Each task scans all windows in the set, left to right,
+	    for its own range of permutations.
+	  */
+	  vector< pair<size_t,size_t> > scan_win;
+	  vector< vector<short> > scan_keep;
+	  vector< vector<ESMBASE> > scan_offsets;
+	  vector<ESMBASE> scan_obs;
+	  for ( int m = 0 ; m < nwin_set; ++m)
 	    {
-	      //throw the vector in data[h] to the function calc_esm(), with some params,and output to ESMP_win[h]
-	      if( indexes_win[h].first != numeric_limits<size_t>::max() ){
-		t[h] = thread(calc_esm, &data[h],ESM_obs_win[h],nperms_tot,nmarkers_win[h],markers_used,&ESMP_win[h],keep_markers_win[h]);
+	      if( indexes_win[m].first != numeric_limits<size_t>::max() ){
+		scan_win.push_back( make_pair(indexes_win[m].first - indexes_set.first,
+					      indexes_win[m].second - indexes_set.first) );
+		scan_keep.push_back( keep_markers_win[m] );
+		scan_offsets.push_back( esm_offsets(nmarkers_win[m],markers_used) );
+		scan_obs.push_back( ESM_obs_win[m] );
 	      }
 	    }
-	  
-	  for ( unsigned h = 0 ; h < t.size(); ++h)
+	  //a few tasks per worker so that stealing can even out the load
+	  size_t ntasks = 4*group.size();
+	  vector< vector<size_t> > nexceed ( ntasks, vector<size_t>(scan_win.size(),0) );
+	  size_t perms_per_task = nperms_tot/ntasks + 1;
+	  for ( size_t h = 0 ; h < ntasks; ++h)
+	    {
+	      size_t firstperm = min(nperms_tot,h*perms_per_task);
+	      size_t nperms_h = min(nperms_tot,firstperm + perms_per_task) - firstperm;
+	      group.submit( bind(calc_esm_scan,ws,nmarkers_set,firstperm,nperms_h,
+				&scan_win,&scan_keep,&scan_offsets,&scan_obs,&nexceed[h]) );
+	    }
+	  group.wait();
+	  for ( size_t w = 0, m = 0 ; m < ESMP_win.size() ; ++m )
+	    {
+	      if( indexes_win[m].first != numeric_limits<size_t>::max() ){
+		size_t nexceed_m = 0;
+		for ( size_t h = 0 ; h < ntasks; ++h)
+		  {
+		    nexceed_m += nexceed[h][w];
+		  }
+		ESMP_win[m] = (ESMBASE)nexceed_m/(ESMBASE)nperms_tot;
+		++w;
+	      }
+	    }
+	}
+      else if( O.stop > 0 )
+	{
+	  /*
+	    Blocks of perms are read in and handed out until every window
+	    has seen O.stop exceedances or there are no perms left, so only
+	    windows with small p-values need all of them.
+	  */
+	  const size_t nperms_all = reader.nperms();
+	  vector<size_t> nexceed ( nwin_set, 0 );
+	  size_t firstperm = 0;
+	  while( true )
+	    {
+	      bool active = false;
+	      for ( int h = 0 ; h < nwin_set; ++h)
+		{
+		  if( indexes_win[h].first != numeric_limits<size_t>::max() && nexceed[h] < O.stop ){
+		    group.submit( bind(calc_esm_sequential,ws,views[h],ESM_obs_win[h],ws->nperms,markers_used,
+				      cref(keep_markers_win[h]),O.stop,&nexceed[h],&used_win[h]) );
+		    active = true;
+		  }
+		}
+	      group.wait();
+	      firstperm += ws->nperms;
+	      if( !active || firstperm >= nperms_all ) { break; }
+	      reader.read_perms(*ws,firstperm,min(O.stopblock,nperms_all-firstperm));
+	    }
+	  for ( int h = 0 ; h < nwin_set; ++h)
 	    {
-	      //Join means come on back to main thread; will wait until all are done.
 	      if( indexes_win[h].first != numeric_limits<size_t>::max() ){
-		t[h].join();
+		//Besag and Clifford's estimate if the window stopped early, else the usual one
+		ESMP_win[h] = (nexceed[h] >= O.stop) ? (ESMBASE)nexceed[h]/(ESMBASE)used_win[h] : (ESMBASE)nexceed[h]/(ESMBASE)nperms_all;
 	      }
 	    }
-	  for ( size_t h = 0 ; h < ESMP_win.size(); ++h)
-	    { 
-	      if ( indexes_win[h].first != numeric_limits<size_t>::max()){
-		midpoints.push_back(loci_mid[h]);
-		p_values.push_back(ESMP_win[h]);
+	  C.perms_read += firstperm;
+	  C.perms_all += nperms_all;
+	}
+      else
+	{
+	  for ( int h = 0 ; h < nwin_set; ++h)
+	    {
+	      //throw the view of window h to the function calc_esm(), with some params,and output to ESMP_win[h]
+	      if( indexes_win[h].first != numeric_limits<size_t>::max() ){
+		group.submit( bind(calc_esm,ws,views[h],ESM_obs_win[h],nperms_tot,markers_used,&ESMP_win[h],cref(keep_markers_win[h])) );
 	      }
 	    }
-	  
-	}//end if there are SNPs in the set
-      //jump forward to the next set of windows
-      left += O.jumpsize*O.nwindows;
-      right += O.jumpsize*O.nwindows;
-      
-    }//end do while loop
- 
-  
-  ofstream output;
-  output.open(O.outfile.c_str());
-  output << "p.values"<<' '<<"loci.midpoint"<<'\n';
-  for ( size_t i = 0; i< p_values.size(); ++i)
-    { 
-      output<<p_values[i]<<' '<<midpoints[i]<<'\n';
-    }
-  output.close();
+	  //come on back to main thread; will wait until all are done.
+	  group.wait();
+	}
+      vector<ESMBASE> p_values,midpoints;
+      vector<size_t> perms_used;
+      for ( size_t h = 0 ; h < ESMP_win.size(); ++h)
+	{
+	  if ( indexes_win[h].first != numeric_limits<size_t>::max()){
+	    midpoints.push_back(loci_mid[h]);
+	    p_values.push_back(ESMP_win[h]);
+	    perms_used.push_back(used_win[h]);
+	    C.perms_used += used_win[h];
+	  }
+	}
+      C.nresults += p_values.size();
+      //the set is done, so write it out and log it along with where the next one starts
+      out.write(c,p_values.data(),midpoints.data(),perms_used.data(),p_values.size());
+      ck.record(C.name,left + O.jumpsize*O.nwindows,p_values.data(),midpoints.data(),
+		perms_used.data(),p_values.size());
+
+    }//end while there are window sets
+
+  C.cache_hits = reader.cache_stats().hits;
+  C.cache_misses = reader.cache_stats().misses;
+  C.read_secs = reader.read_seconds();
 }
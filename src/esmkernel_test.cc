@@ -0,0 +1,280 @@
+/*
+  Checks that every ESM kernel gives the same counts as the original
+  implementation, which sorted all of a window's values for every
+  permutation.  The observed ESMs are taken from the permutations
+  themselves, and one ulp either side of them, so the counts only agree
+  if the kernels' ESMs are bit-identical to the original ones.
+
+  The kernels for quantized perms, which look the values up in a
+  table, must give the same counts as the float ones on the looked-up
+  values.
+
+  Run by make check.  Returns 0 if all counts agree.
+*/
+
+#include <ESMkernel.hpp>
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <functional>
+#include <random>
+#include <cmath>
+#include <cstdlib>
+#include <cstdint>
+
+using namespace std;
+
+namespace
+{
+  //The ESM of one permutation as the original esmk computed it
+  ESMBASE esm_fullsort( const ESMBASE * perm,
+			const int & nmarkers,
+			const int & K,
+			const short * keep )
+  {
+    vector<ESMBASE> temp;
+    for ( int k = 0 ; k < nmarkers ; ++k )
+      {
+	temp.push_back(perm[k]*keep[k]);
+      }
+    sort( temp.begin(),temp.end(),greater<ESMBASE>() );
+    ESMBASE ESM = 0;
+    for ( int k = 0 ; k < min(K,nmarkers) ; ++k )
+      {
+	ESM += temp[k] + log10(((ESMBASE) k + 1) / (ESMBASE) nmarkers);
+      }
+    return ESM;
+  }
+
+  size_t count_fullsort( const ESMBASE * data,
+			 const size_t & nperms,
+			 const int & nmarkers,
+			 const size_t & stride,
+			 const int & K,
+			 const short * keep,
+			 const ESMBASE & ESM_obs )
+  {
+    size_t n = 0;
+    for ( size_t j = 0 ; j < nperms ; ++j )
+      {
+	n += ( esm_fullsort(data + stride*j,nmarkers,K,keep) >= ESM_obs );
+      }
+    return n;
+  }
+
+  /*
+    Observed ESMs to test against: those of a few permutations, one ulp
+    either side of them, and one that no permutation reaches.
+  */
+  vector<ESMBASE> observed( const ESMBASE * data,
+			    const size_t & nperms,
+			    const int & nmarkers,
+			    const size_t & stride,
+			    const int & K,
+			    const short * keep,
+			    mt19937 & rng )
+  {
+    vector<ESMBASE> rv;
+    for ( int i = 0 ; i < 4 ; ++i )
+      {
+	const ESMBASE e = esm_fullsort(data + stride*(rng() % nperms),nmarkers,K,keep);
+	rv.push_back(e);
+	rv.push_back(nextafter(e,ESMBASE(-HUGE_VAL)));
+	rv.push_back(nextafter(e,ESMBASE(HUGE_VAL)));
+      }
+    rv.push_back(ESMBASE(1e30));
+    return rv;
+  }
+
+  /*
+    -log10 p values: continuous ones, or few distinct ones (so there
+    are many ties) with zeros, as for markers with no variation.
+  */
+  void fill( vector<ESMBASE> & data, const bool & ties, mt19937 & rng )
+  {
+    uniform_real_distribution<double> U(1e-12,1.);
+    const ESMBASE levels[] = { 0., 0., 0.5, 1., 1., 2., 3.25 };
+    for ( size_t i = 0 ; i < data.size() ; ++i )
+      {
+	data[i] = ties ? levels[rng() % 7] : ESMBASE(-log10(U(rng)));
+      }
+  }
+
+  /*
+    Rounds data to multiples of 0.001, as perms2h5 --quantize does,
+    into q, and replaces data with the values of q in table.
+  */
+  void quantize( vector<ESMBASE> & data, vector<uint16_t> & q, const vector<ESMBASE> & table )
+  {
+    q.resize(data.size());
+    for ( size_t i = 0 ; i < data.size() ; ++i )
+      {
+	q[i] = uint16_t(min(65535.,floor(double(data[i])*1000. + 0.5)));
+	data[i] = table[q[i]];
+      }
+  }
+
+  vector<short> random_keep( const size_t & n, mt19937 & rng )
+  {
+    vector<short> keep(n);
+    for ( size_t i = 0 ; i < n ; ++i )
+      {
+	keep[i] = ( rng() % 5 != 0 );
+      }
+    return keep;
+  }
+}
+
+int main( void )
+{
+  mt19937 rng(20160208);
+  size_t nfailed = 0, nchecked = 0;
+  const char * kernels[] = { "scalar", "avx2", "avx512" };
+  const int Ks[] = { 1, 2, 5, 20, 60, 500 };
+  const int Ms[] = { 1, 3, 17, 50, 131 };
+  const size_t nperms_all[] = { 1, 7, 16, 100, 259 };
+
+  for ( int kn = 0 ; kn < 3 ; ++kn )
+    {
+      if( !set_esm_kernel(kernels[kn]) )
+	{
+	  cerr << "kernel " << kernels[kn] << " is not supported on this CPU, skipped\n";
+	  continue;
+	}
+      for ( int ties = 0 ; ties < 2 ; ++ties )
+	for ( int ik = 0 ; ik < 6 ; ++ik )
+	  for ( int im = 0 ; im < 5 ; ++im )
+	    for ( int ip = 0 ; ip < 5 ; ++ip )
+	      for ( size_t pad = 0 ; pad < 20 ; pad += 9 )
+		{
+		  const int K = Ks[ik], M = Ms[im];
+		  const size_t nperms = nperms_all[ip], stride = M + pad;
+		  vector<ESMBASE> data(stride*nperms);
+		  fill(data,ties,rng);
+		  vector<short> keep = random_keep(M,rng);
+		  const vector<ESMBASE> offsets = esm_offsets(M,K);
+		  const vector<ESMBASE> obs = observed(data.data(),nperms,M,stride,K,keep.data(),rng);
+		  for ( size_t o = 0 ; o < obs.size() ; ++o )
+		    {
+		      const size_t want = count_fullsort(data.data(),nperms,M,stride,K,keep.data(),obs[o]);
+		      const size_t got = esm_exceedances(data.data(),nperms,M,stride,keep.data(),offsets,obs[o]);
+		      ++nchecked;
+		      if( got != want )
+			{
+			  ++nfailed;
+			  cerr << "esm_exceedances (" << kernels[kn] << "): K = " << K << ", M = " << M
+			       << ", stride = " << stride << ", nperms = " << nperms << ", ties = " << ties
+			       << ": " << got << " exceedances, the full sort gives " << want << '\n';
+			}
+		    }
+		}
+    }
+
+  //the values of the quantized perms, as perm_reader reads them
+  vector<ESMBASE> table(65536);
+  for ( size_t q = 0 ; q < table.size() ; ++q )
+    {
+      table[q] = ESMBASE(0. + 0.001*q);
+    }
+  for ( int kn = 0 ; kn < 3 ; ++kn )
+    {
+      if( !set_esm_kernel(kernels[kn]) )
+	{
+	  continue;
+	}
+      for ( int ties = 0 ; ties < 2 ; ++ties )
+	for ( int ik = 0 ; ik < 6 ; ++ik )
+	  for ( int im = 0 ; im < 5 ; ++im )
+	    for ( int ip = 0 ; ip < 5 ; ++ip )
+	      {
+		const int K = Ks[ik], M = Ms[im];
+		const size_t nperms = nperms_all[ip], stride = M + 9;
+		vector<ESMBASE> data(stride*nperms);
+		vector<uint16_t> q;
+		fill(data,ties,rng);
+		quantize(data,q,table);
+		vector<short> keep = random_keep(M,rng);
+		const vector<ESMBASE> offsets = esm_offsets(M,K);
+		const vector<ESMBASE> obs = observed(data.data(),nperms,M,stride,K,keep.data(),rng);
+		for ( size_t o = 0 ; o < obs.size() ; ++o )
+		  {
+		    const size_t want = esm_exceedances(data.data(),nperms,M,stride,keep.data(),offsets,obs[o]);
+		    const size_t got = esm_exceedances(q.data(),table.data(),nperms,M,stride,keep.data(),offsets,obs[o]);
+		    ++nchecked;
+		    if( got != want )
+		      {
+			++nfailed;
+			cerr << "esm_exceedances, quantized (" << kernels[kn] << "): K = " << K << ", M = " << M
+			     << ", nperms = " << nperms << ", ties = " << ties << ": " << got
+			     << " exceedances, the float version gives " << want << '\n';
+		      }
+		  }
+	      }
+    }
+
+  /*
+    esm_scan_exceedances, on runs of windows that overlap by different
+    amounts (or not at all), of varying widths and LD filters.  As in
+    esmk, both ends of the windows move right.
+  */
+  const size_t jumps[] = { 1, 3, 10, 40 };
+  for ( int ties = 0 ; ties < 2 ; ++ties )
+    for ( int ik = 0 ; ik < 6 ; ++ik )
+      for ( int ij = 0 ; ij < 4 ; ++ij )
+	for ( size_t pad = 0 ; pad < 20 ; pad += 9 )
+	  {
+	    const int K = Ks[ik];
+	    const size_t ncols = 120, nperms = 150, stride = ncols + pad;
+	    vector<ESMBASE> data(stride*nperms);
+	    fill(data,ties,rng);
+	    vector< pair<size_t,size_t> > windows;
+	    vector< vector<short> > keep;
+	    vector< vector<ESMBASE> > offsets;
+	    vector<ESMBASE> obs;
+	    size_t last = 0;
+	    for ( size_t first = 0 ; first < ncols ; first += jumps[ij] )
+	      {
+		last = min(ncols - 1,max(last,first + rng() % 30));
+		windows.push_back(make_pair(first,last));
+		const int M = int(last - first + 1);
+		keep.push_back(random_keep(M,rng));
+		offsets.push_back(esm_offsets(M,K));
+		const vector<ESMBASE> o = observed(&data[first],nperms,M,stride,K,keep.back().data(),rng);
+		obs.push_back(o[rng() % o.size()]);
+	      }
+	    vector<size_t> got(windows.size(),0);
+	    esm_scan_exceedances(data.data(),stride,nperms,windows,keep,offsets,obs,got);
+	    //and the quantized version against the float one
+	    vector<ESMBASE> qdata(data);
+	    vector<uint16_t> q;
+	    quantize(qdata,q,table);
+	    vector<size_t> qwant(windows.size(),0), qgot(windows.size(),0);
+	    esm_scan_exceedances(qdata.data(),stride,nperms,windows,keep,offsets,obs,qwant);
+	    esm_scan_exceedances(q.data(),table.data(),stride,nperms,windows,keep,offsets,obs,qgot);
+	    nchecked += windows.size();
+	    if( qgot != qwant )
+	      {
+		++nfailed;
+		cerr << "esm_scan_exceedances, quantized: K = " << K << ", jump = " << jumps[ij]
+		     << ", ties = " << ties << ": the counts differ from the float version\n";
+	      }
+	    for ( size_t w = 0 ; w < windows.size() ; ++w )
+	      {
+		const int M = int(windows[w].second - windows[w].first + 1);
+		const size_t want = count_fullsort(&data[windows[w].first],nperms,M,stride,K,keep[w].data(),obs[w]);
+		++nchecked;
+		if( got[w] != want )
+		  {
+		    ++nfailed;
+		    cerr << "esm_scan_exceedances: K = " << K << ", jump = " << jumps[ij]
+			 << ", window " << windows[w].first << '-' << windows[w].second
+			 << ", ties = " << ties << ": " << got[w]
+			 << " exceedances, the full sort gives " << want << '\n';
+		  }
+	      }
+	  }
+
+  cerr << nchecked - nfailed << " of " << nchecked << " counts agree with the full sort\n";
+  return nfailed == 0 ? 0 : 1;
+}
@@ -0,0 +1,514 @@
+/*
+  Merges the HDF5 files written by perms2h5 for the same markers into
+  one, with the permutations of each file in turn.
+
+  Everything but /Perms/permutations is copied from the first file, once
+  the markers, LD pairs and observed values of every file have been
+  checked against it.  The permutations are copied a chunk at a time
+  with H5Dread_chunk/H5Dwrite_chunk, as the bytes stored in the file, so
+  they are never decompressed and compressed again.
+
+  A chunk can only be copied as it is when it lands on a chunk boundary
+  of the output, with the same chunk shape and filters.  Rows for which
+  that is not so (those after a file whose number of perms is not a
+  multiple of the chunk's, or in a file with another layout) are read
+  and written through HDF5 as usual, so no perms are ever dropped.
+
+  With --virtual, nothing is copied but the markers, the LD and the
+  rest of the first file: /Perms/permutations is instead an HDF5
+  virtual dataset that maps each input's permutations, in turn, onto
+  its rows, so the output is a small view that takes as long to write
+  however many perms there are.  The inputs are found by their paths
+  relative to the output, so they must stay where they are (or move
+  along with it).  esmk reads such a view as one input.
+*/
+
+//Command line parsing using boost (C++)
+#include <boost/program_options.hpp>
+
+#include <H5Cpp.h>
+#include <H5util.hpp>
+#include <H5filters.hpp>
+#include <ESMH5type.hpp>
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <exception>
+#include <climits>
+#include <stdlib.h>
+
+using namespace std;
+using namespace boost::program_options;
+using namespace H5;
+
+struct options
+/*
+  This object represents the command-line options
+ */
+{
+  vector<string> infiles;
+  string outfile;
+  size_t budget;
+  bool verbose,virt;
+  options(void);
+};
+
+options::options(void) : infiles(vector<string>()),
+			 outfile(string()),
+			 budget(256),
+			 verbose(false),
+			 virt(false)
+{
+}
+
+options process_argv( int argc, char ** argv );
+//Exits with an error unless every file has the markers, LD pairs and observed values of the first
+void check_inputs( const options & O );
+//Copies everything in the first file but /Perms/permutations into ofile
+void copy_metadata( const options & O, H5File & ofile );
+//The number of perms in each file's /Perms/permutations, which must all have the same number of markers, ncols
+vector<hsize_t> count_perms( const options & O, hsize_t & ncols );
+//Creates /Perms/permutations in ofile, with the layout of the first file's, and fills it in
+void merge_perms( const options & O, H5File & ofile );
+//Creates /Perms/permutations in ofile as a virtual dataset over the files' permutations
+void link_perms( const options & O, H5File & ofile );
+//path, which is relative to the working directory, as seen from the directory that file is in
+string relative_to( const string & path, const string & file );
+//The scale and offset of perms stored by perms2h5 --quantize, or nothing if they are not
+vector<double> quantization( const DataSet & d );
+//Copies the attributes of from, such as the scale and offset of quantized perms, to to
+void copy_attributes( const DataSet & from, DataSet & to );
+//true if the two dataset creation property lists have the same chunk shape and filters
+bool same_layout( const DSetCreatPropList & a, const DSetCreatPropList & b );
+/*
+  Copies the chunks for rows [0,nrows) of in to ofile, starting at row
+  offset, which must be a multiple of the chunk's rows.  nrows must be
+  too, unless the rows run to the end of out.
+*/
+void copy_chunks( DataSet & in, DataSet & out, const hsize_t & offset,
+		  const hsize_t & nrows, const hsize_t * chunk, const hsize_t & ncols );
+//Reads rows [first,nrows) of in and writes them to out, from row offset + first on
+void copy_rows( const options & O, DataSet & in, DataSet & out, const hsize_t & offset,
+		const hsize_t & first, const hsize_t & nrows, const hsize_t & ncols );
+
+int main( int argc, char ** argv )
+{
+  options O = process_argv( argc, argv );
+  //perms compressed with lz4 or zstd need the filters to be copied row by row
+  register_filters();
+  try
+    {
+      check_inputs( O );
+    }
+  catch( const exception & e )
+    {
+      cerr << "Error: " << e.what() << '\n';
+      exit(10);
+    }
+  if ( O.verbose )
+    {
+      cerr << "The markers of all " << O.infiles.size() << " files agree.\n";
+    }
+  H5File ofile( O.outfile.c_str(), H5F_ACC_TRUNC );
+  copy_metadata( O, ofile );
+  if( O.virt )
+    {
+      link_perms( O, ofile );
+    }
+  else
+    {
+      merge_perms( O, ofile );
+    }
+  ofile.close();
+  exit(0);
+}
+
+options process_argv( int argc, char ** argv )
+{
+  options rv;
+
+  options_description desc("Merges the HDF5 files written by perms2h5 for the same markers, appending their permutations.");
+  desc.add_options()
+    ("help,h", "Produce help message")
+    ("infiles,i",value<vector<string> >(&rv.infiles)->multitoken(),"The files to merge, in the order their perms are to go")
+    ("outfile,o",value<string>(&rv.outfile)->default_value(string()),"Output file name.  Format is HDF5")
+    ("budget,b",value<size_t>(&rv.budget)->default_value(256),"Memory in mega bytes for perms that cannot be copied chunk by chunk, default = 256MB")
+    ("virtual","Write a view of the inputs' permutations (an HDF5 virtual dataset) instead of copying them.  The inputs must then be kept, at the same place relative to the output")
+    ("verbose,v","Write process info to STDERR")
+    ;
+
+  variables_map vm;
+  store( command_line_parser(argc, argv).options(desc).run(), vm );
+  notify(vm);
+
+  if ( argc == 1 || vm.count("help") )
+    {
+      cerr << desc << '\n';
+      exit(0);
+    }
+
+  if( rv.infiles.empty() || rv.outfile.empty() )
+    {
+      cerr << "Error: input and output file names are required.\n"
+	   << desc << '\n';
+      exit(10);
+    }
+  if( find(rv.infiles.begin(),rv.infiles.end(),rv.outfile) != rv.infiles.end() )
+    {
+      cerr << "Error: the output file cannot be one of the inputs.\n";
+      exit(10);
+    }
+  if( vm.count("verbose") )
+    {
+      rv.verbose = true;
+    }
+  if( vm.count("virtual") )
+    {
+      rv.virt = true;
+    }
+  return rv;
+}
+
+void check_inputs( const options & O )
+{
+  const char * first = O.infiles[0].c_str();
+  for( size_t i = 0 ; i < O.infiles.size() ; ++i )
+    {
+      if( !has_dataset(O.infiles[i].c_str(),"/Perms/permutations") )
+	{
+	  cerr << "Error: " << O.infiles[i] << " has no /Perms/permutations.  "
+	       << "Files written with --transpose cannot be merged.\n";
+	  exit(10);
+	}
+    }
+  const vector<string> markers_0 = read_strings(first,"/Markers/IDs"),
+    chroms_0 = read_strings(first,"/Markers/chr"),
+    snpA_0 = read_strings(first,"/LD/snpA"),
+    snpB_0 = read_strings(first,"/LD/snpB");
+  const vector<int> pos_0 = read_ints(first,"/Markers/pos");
+  const vector<ESMBASE> observed_0 = read_doubles(first,"/Perms/observed");
+  H5File file_0( first, H5F_ACC_RDONLY );
+  const DataSet perms_0 = file_0.openDataSet("/Perms/permutations");
+  const DataType type_0 = perms_0.getDataType();
+  const vector<double> q_0 = quantization(perms_0);
+  for( size_t i = 1 ; i < O.infiles.size() ; ++i )
+    {
+      const char * name = O.infiles[i].c_str();
+      string what;
+      if( read_strings(name,"/Markers/IDs") != markers_0 ) { what = "marker IDs"; }
+      else if( read_strings(name,"/Markers/chr") != chroms_0 ) { what = "chromosomes"; }
+      else if( read_ints(name,"/Markers/pos") != pos_0 ) { what = "positions"; }
+      else if( read_strings(name,"/LD/snpA") != snpA_0 || read_strings(name,"/LD/snpB") != snpB_0 ) { what = "LD pairs"; }
+      else if( read_doubles(name,"/Perms/observed") != observed_0 ) { what = "observed values"; }
+      else
+	{
+	  //the perms must be stored as the same type, with the same scale if quantized
+	  H5File file_i( name, H5F_ACC_RDONLY );
+	  const DataSet perms_i = file_i.openDataSet("/Perms/permutations");
+	  if( !(perms_i.getDataType() == type_0) || quantization(perms_i) != q_0 ) { what = "type (or quantization) of the perms"; }
+	}
+      if( !what.empty() )
+	{
+	  cerr << "Error: the " << what << " of " << O.infiles[i]
+	       << " are not those of " << O.infiles[0] << ".\n";
+	  exit(10);
+	}
+    }
+}
+
+void copy_metadata( const options & O, H5File & ofile )
+{
+  H5File in( O.infiles[0].c_str(), H5F_ACC_RDONLY );
+  //the groups, and the datasets in /Perms, but for the permutations, go over as they are
+  for( hsize_t i = 0 ; i < in.getNumObjs() ; ++i )
+    {
+      const string name = in.getObjnameByIdx(i);
+      if( name != "Perms" )
+	{
+	  H5Ocopy(in.getId(),name.c_str(),ofile.getId(),name.c_str(),H5P_DEFAULT,H5P_DEFAULT);
+	}
+    }
+  Group perms = in.openGroup("/Perms");
+  Group operms = ofile.createGroup("/Perms");
+  for( hsize_t i = 0 ; i < perms.getNumObjs() ; ++i )
+    {
+      const string name = perms.getObjnameByIdx(i);
+      if( name != "permutations" )
+	{
+	  H5Ocopy(perms.getId(),name.c_str(),operms.getId(),name.c_str(),H5P_DEFAULT,H5P_DEFAULT);
+	}
+    }
+}
+
+vector<double> quantization( const DataSet & d )
+{
+  vector<double> rv;
+  if( d.attrExists("scale") )
+    {
+      double x = 0.;
+      d.openAttribute("scale").read(PredType::NATIVE_DOUBLE,&x);
+      rv.push_back(x);
+      x = 0.;
+      if( d.attrExists("offset") )
+	{
+	  d.openAttribute("offset").read(PredType::NATIVE_DOUBLE,&x);
+	}
+      rv.push_back(x);
+    }
+  return rv;
+}
+
+void copy_attributes( const DataSet & from, DataSet & to )
+{
+  for( int i = 0 ; i < from.getNumAttrs() ; ++i )
+    {
+      const Attribute a = from.openAttribute(unsigned(i));
+      const DataType type = a.getDataType();
+      const DataSpace space = a.getSpace();
+      vector<char> value( type.getSize()*size_t(max(space.getSimpleExtentNpoints(),hssize_t(1))) );
+      a.read(type,value.data());
+      to.createAttribute(a.getName(),type,space).write(type,value.data());
+    }
+}
+
+bool same_layout( const DSetCreatPropList & a, const DSetCreatPropList & b )
+{
+  if( a.getLayout() != H5D_CHUNKED || b.getLayout() != H5D_CHUNKED ) { return false; }
+  const int rank = a.getChunk(0,NULL);
+  if( rank != b.getChunk(0,NULL) ) { return false; }
+  vector<hsize_t> ca(rank),cb(rank);
+  a.getChunk(rank,ca.data());
+  b.getChunk(rank,cb.data());
+  if( ca != cb || a.getNfilters() != b.getNfilters() ) { return false; }
+  for( int f = 0 ; f < a.getNfilters() ; ++f )
+    {
+      unsigned flags;
+      size_t na = 16, nb = 16;
+      vector<unsigned> va(na),vb(nb);
+      unsigned config;
+      char name[64];
+      const H5Z_filter_t fa = a.getFilter(f,flags,na,va.data(),sizeof(name),name,config),
+	fb = b.getFilter(f,flags,nb,vb.data(),sizeof(name),name,config);
+      va.resize(min(na,size_t(16)));
+      vb.resize(min(nb,size_t(16)));
+      if( fa != fb || va != vb ) { return false; }
+    }
+  return true;
+}
+
+vector<hsize_t> count_perms( const options & O, hsize_t & ncols )
+{
+  ncols = 0;
+  vector<hsize_t> nrows(O.infiles.size());
+  for( size_t i = 0 ; i < O.infiles.size() ; ++i )
+    {
+      H5File in( O.infiles[i].c_str(), H5F_ACC_RDONLY );
+      DataSpace space = in.openDataSet("/Perms/permutations").getSpace();
+      hsize_t dims[2];
+      if( space.getSimpleExtentNdims() != 2 )
+	{
+	  cerr << "Error: /Perms/permutations of " << O.infiles[i] << " is not a matrix.\n";
+	  exit(10);
+	}
+      space.getSimpleExtentDims(dims);
+      if( i > 0 && dims[1] != ncols )
+	{
+	  cerr << "Error: " << O.infiles[i] << " has " << dims[1] << " markers in /Perms/permutations, not "
+	       << ncols << ".\n";
+	  exit(10);
+	}
+      ncols = dims[1];
+      nrows[i] = dims[0];
+    }
+  return nrows;
+}
+
+void merge_perms( const options & O, H5File & ofile )
+{
+  const auto start = chrono::steady_clock::now();
+  //the output's layout is the first file's
+  hsize_t ncols = 0;
+  const vector<hsize_t> nrows = count_perms( O, ncols );
+  const hsize_t total = accumulate( nrows.begin(), nrows.end(), hsize_t(0) );
+  H5File first( O.infiles[0].c_str(), H5F_ACC_RDONLY );
+  DataSet d0 = first.openDataSet("/Perms/permutations");
+  const DSetCreatPropList cparms = d0.getCreatePlist();
+  if( cparms.getLayout() != H5D_CHUNKED )
+    {
+      cerr << "Error: /Perms/permutations of " << O.infiles[0] << " is not chunked.\n";
+      exit(10);
+    }
+  hsize_t chunk[2];
+  cparms.getChunk(2,chunk);
+  const hsize_t dims[2] = {total,ncols}, maxdims[2] = {H5S_UNLIMITED,ncols};
+  DataSpace ospace(2,dims,maxdims);
+  DataSet out = ofile.createDataSet("/Perms/permutations",d0.getDataType(),ospace,cparms);
+  copy_attributes( d0, out );
+
+  hsize_t offset = 0, nraw = 0;
+  for( size_t i = 0 ; i < O.infiles.size() ; ++i )
+    {
+      H5File in( O.infiles[i].c_str(), H5F_ACC_RDONLY );
+      DataSet d = in.openDataSet("/Perms/permutations");
+      const bool last = (i + 1 == O.infiles.size());
+      /*
+	Whole chunks go over as they are while they land on the output's
+	chunk boundaries.  The last file's short final chunk can too, as
+	its padding falls outside the output.
+      */
+      hsize_t raw = 0;
+      if( offset % chunk[0] == 0 && d.getDataType() == d0.getDataType() && same_layout(d.getCreatePlist(),cparms) )
+	{
+	  raw = last ? nrows[i] : (nrows[i]/chunk[0])*chunk[0];
+	}
+      copy_chunks( d, out, offset, raw, chunk, ncols );
+      copy_rows( O, d, out, offset, raw, nrows[i], ncols );
+      if( O.verbose )
+	{
+	  cerr << O.infiles[i] << ": " << nrows[i] << " perms, " << raw << " copied chunk by chunk";
+	  if( raw < nrows[i] ) { cerr << ", " << nrows[i] - raw << " rewritten"; }
+	  cerr << '\n';
+	}
+      offset += nrows[i];
+      nraw += raw;
+    }
+  if( O.verbose )
+    {
+      const double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+      const double MB = double(total)*double(ncols)*double(d0.getDataType().getSize())/(1024.*1024.);
+      cerr << "Merged " << total << " perms (" << MB << " MB) in " << secs << " s ("
+	   << MB/max(secs,1e-9) << " MB/s); " << nraw << " were copied chunk by chunk.\n";
+    }
+}
+
+void link_perms( const options & O, H5File & ofile )
+{
+  const auto start = chrono::steady_clock::now();
+  hsize_t ncols = 0;
+  const vector<hsize_t> nrows = count_perms( O, ncols );
+  const hsize_t total = accumulate( nrows.begin(), nrows.end(), hsize_t(0) );
+  H5File first( O.infiles[0].c_str(), H5F_ACC_RDONLY );
+  const DataSet d0 = first.openDataSet("/Perms/permutations");
+  const DataType type = d0.getDataType();
+
+  //each file's perms are a block of whole rows, one after the other
+  const hsize_t dims[2] = {total,ncols};
+  DataSpace vspace(2,dims);
+  DSetCreatPropList cparms;
+  hsize_t offset = 0;
+  for( size_t i = 0 ; i < O.infiles.size() ; ++i )
+    {
+      const hsize_t start[2] = {offset,0}, count[2] = {nrows[i],ncols};
+      DataSpace srcspace(2,count);
+      vspace.selectHyperslab(H5S_SELECT_SET,count,start);
+      const string name = relative_to( O.infiles[i], O.outfile );
+      if( H5Pset_virtual(cparms.getId(),vspace.getId(),name.c_str(),"/Perms/permutations",srcspace.getId()) < 0 )
+	{
+	  cerr << "Error: could not map the perms of " << O.infiles[i] << ".\n";
+	  exit(10);
+	}
+      if( O.verbose )
+	{
+	  cerr << O.infiles[i] << ": " << nrows[i] << " perms, as " << name << '\n';
+	}
+      offset += nrows[i];
+    }
+  vspace.selectAll();
+  DataSet out = ofile.createDataSet("/Perms/permutations",type,vspace,cparms);
+  copy_attributes( d0, out );
+  if( O.verbose )
+    {
+      const double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+      cerr << "Mapped " << total << " perms of " << O.infiles.size() << " files in " << secs << " s.\n";
+    }
+}
+
+string relative_to( const string & path, const string & file )
+{
+  if( !path.empty() && path[0] == '/' ) { return path; }
+  const size_t slash = file.rfind('/');
+  if( slash == string::npos ) { return path; }
+  //compare the real paths of path and of file's directory, component by component
+  char a[PATH_MAX], b[PATH_MAX];
+  const string dir = file.substr(0,slash+1);
+  if( realpath(path.c_str(),a) == NULL )
+    {
+      cerr << "Error: could not find " << path << ".\n";
+      exit(10);
+    }
+  if( realpath(dir.c_str(),b) == NULL )
+    {
+      cerr << "Error: could not find " << dir << ".\n";
+      exit(10);
+    }
+  const string from = string(b) + '/', to = a;
+  size_t common = 0;
+  for( size_t k = 0 ; k < from.size() && k < to.size() && from[k] == to[k] ; ++k )
+    {
+      if( from[k] == '/' ) { common = k + 1; }
+    }
+  string rv;
+  for( size_t k = common ; k < from.size() ; ++k )
+    {
+      if( from[k] == '/' ) { rv += "../"; }
+    }
+  return rv + to.substr(common);
+}
+
+void copy_chunks( DataSet & in, DataSet & out, const hsize_t & offset,
+		  const hsize_t & nrows, const hsize_t * chunk, const hsize_t & ncols )
+{
+  vector<char> buffer;
+  for( hsize_t r = 0 ; r < nrows ; r += chunk[0] )
+    {
+      for( hsize_t c = 0 ; c < ncols ; c += chunk[1] )
+	{
+	  hsize_t from[2] = {r,c}, to[2] = {offset + r,c};
+	  hsize_t nbytes = 0;
+	  if( H5Dget_chunk_storage_size(in.getId(),from,&nbytes) < 0 )
+	    {
+	      cerr << "Error: could not read the chunk at perm " << r << ", marker " << c << ".\n";
+	      exit(10);
+	    }
+	  //a chunk that was never written is left as it is, all fill value
+	  if( nbytes == 0 ) { continue; }
+	  buffer.resize(nbytes);
+	  uint32_t mask = 0;
+	  if( H5Dread_chunk(in.getId(),H5P_DEFAULT,from,&mask,buffer.data()) < 0 ||
+	      H5Dwrite_chunk(out.getId(),H5P_DEFAULT,mask,to,nbytes,buffer.data()) < 0 )
+	    {
+	      cerr << "Error: could not copy the chunk at perm " << r << ", marker " << c << ".\n";
+	      exit(10);
+	    }
+	}
+    }
+}
+
+void copy_rows( const options & O, DataSet & in, DataSet & out, const hsize_t & offset,
+		const hsize_t & first, const hsize_t & nrows, const hsize_t & ncols )
+{
+  if( first >= nrows ) { return; }
+  const hsize_t rowbytes = max(ncols,hsize_t(1))*sizeof(ESMBASE);
+  const hsize_t block = max(hsize_t(1),hsize_t(O.budget)*1024*1024/rowbytes);
+  vector<ESMBASE> rows;
+  DataSpace inspace = in.getSpace(), outspace = out.getSpace();
+  const PredType & memtype = (sizeof(ESMBASE) == sizeof(float)) ? PredType::NATIVE_FLOAT : PredType::NATIVE_DOUBLE;
+  for( hsize_t r = first ; r < nrows ; r += block )
+    {
+      const hsize_t n = min(block,nrows - r);
+      rows.resize(n*ncols);
+      hsize_t count[2] = {n,ncols}, from[2] = {r,0}, to[2] = {offset + r,0};
+      DataSpace memspace(2,count);
+      inspace.selectHyperslab(H5S_SELECT_SET,count,from);
+      outspace.selectHyperslab(H5S_SELECT_SET,count,to);
+      in.read(rows.data(),memtype,memspace,inspace);
+      out.write(rows.data(),memtype,memspace,outspace);
+    }
+}
@@ -7,9 +7,13 @@
 
 #include <H5Cpp.h>
 #include <ESMH5type.hpp>
+#include <DumpReader.hpp>
+#include <ThreadPool.hpp>
+#include <BoundedQueue.hpp>
+#include <H5filters.hpp>
 
-//Headers to conver chi-squared statistic into chi-squared p-value.  GNU Scientific Library (C language)
-#include <gsl/gsl_cdf.h>
+//Converts chi-squared statistics into -log10 p-values
+#include <Pvalue.hpp>
 
 //standard C++ headers that we need
 #include <sstream>
@@ -22,6 +26,11 @@
 #include <cctype>
 #include <cstring>
 #include <typeinfo>
+#include <chrono>
+#include <thread>
+#include <future>
+#include <memory>
+#include <cstdint>
 
 using namespace std;
 using namespace boost::program_options;
@@ -32,9 +41,16 @@ struct options
   This object represents the command-line options
  */
 {
-  bool strip,convert,verbose,compression,dbprec,nochunk;
+  bool strip,convert,verbose,compression,dbprec,nochunk,transpose;
   string bimfile,ldfile,infile,outfile;
-  size_t nrecords,ccache,cmarkers;
+  size_t nrecords,ccache,cmarkers,tperms,tbudget;
+  unsigned nthreads;
+  //with --quantize, the perms are stored as multiples of qstep in 16 bits
+  double qstep;
+  //with --compression, the perms are shuffled and then compressed with filter at clevel
+  string codec;
+  int clevel;
+  H5Z_filter_t filter;
   options(void);
 };
 
@@ -44,24 +60,81 @@ options::options(void) : strip(true),
 			 compression(false),
 			 dbprec(false),
 			 nochunk(false),
+			 transpose(false),
 			 bimfile(string()),
 			 ldfile(string()),
 			 infile(string()),
 			 outfile(string()),
 			 nrecords(1),
 			 ccache(5),
-			 cmarkers(50)
+			 cmarkers(50),
+			 tperms(10000),
+			 tbudget(1024),
+			 nthreads(max(thread::hardware_concurrency(),1u)),
+			 qstep(0.),
+			 codec("deflate"),
+			 clevel(0),
+			 filter(H5Z_FILTER_DEFLATE)
 {
 }
 
 options process_argv( int argc, char ** argv );
 size_t process_bimfile( const options & O, H5File & ofile );
 void process_ldfile( const options & O, H5File & ofile );
-void process_perms( const options & O, size_t nmarkers, H5File & ofile );
+/*
+  The observed data go to ofile and the perms go to /Perms/permutations in permfile,
+  which is normally the same file.
+
+  The perms go through a pipeline: a reader thread cuts the input into
+  batches of O.nrecords records, O.nthreads workers parse, convert and
+  compress each batch into the chunks of one row of chunks of
+  /Perms/permutations, and this thread writes the chunks, in order, with
+  H5Dwrite_chunk.  At most a few batches per worker are in flight at once.
+*/
+void process_perms( const options & O, size_t nmarkers, H5File & ofile, H5File & permfile );
+//One batch of records, as the chunks of one row of chunks of /Perms/permutations
+struct perm_batch
+{
+  bool ok;
+  size_t nrecs;
+  vector< vector<char> > chunks;
+};
+//Parses, converts and chunks nrecs records of text; run by the workers
+perm_batch process_batch( const options & O, const size_t & nmarkers,
+			  const size_t & nrecs, const vector<char> & text );
+/*
+  Unless --noconvert, replaces the n chi^2 values by -log10 of their
+  p-values (1 df).  A value of exactly 1 has always become 0.
+*/
+void convert_values( ESMBASE * data, const size_t & n );
+/*
+  With --quantize, the perms are stored as unsigned 16-bit integers q,
+  standing for offset + scale*q, with scale (O.qstep) and offset (0)
+  as attributes of the dataset.  Values are rounded to the nearest
+  step; those below 0 (or NaN) become 0 and those above 65535 steps
+  become 65535.
+*/
+void quantize_values( const ESMBASE * data, const size_t & n,
+		      const double & step, uint16_t * q );
+//The type the perms are stored as, and its attributes when quantized
+const PredType & perm_type( const options & O );
+void set_quantization( const options & O, DataSet & d );
+//With --compression, the filters of the perms: shuffle, then O.filter at O.clevel
+void set_compression( const options & O, DSetCreatPropList & cparms );
+//With --verbose, how fast the dump was read in (and converted and written out)
+void report_throughput( const options & O, const DumpReader & in,
+			const std::chrono::steady_clock::time_point & start );
+/*
+  Writes /Perms/permutations from permfile into ofile as its
+  [nmarkers x nperms] transpose, /Perms/permutations_T, 
+  holding at most O.tbudget MB in memory at a time.
+*/
+void transpose_perms( const options & O, H5File & permfile, H5File & ofile );
 void firstprime ( size_t & num );
 int main( int argc, char ** argv )
 {
   options O = process_argv( argc, argv );
+  register_filters();
   
   //Create output file
   size_t cache_bytes = O.ccache*1024*1024; //param in mb -> b
@@ -90,7 +163,27 @@ int main( int argc, char ** argv )
   //Preemption policy set to no preemption
   H5File ofile( O.outfile.c_str() , H5F_ACC_TRUNC,H5P_DEFAULT,fapl );
   size_t nmarkers = process_bimfile( O, ofile );
-  process_perms( O, nmarkers, ofile );
+  if( O.transpose )
+    {
+      /*
+	Perms come in one at a time, so they are first written perm-major,
+	uncompressed, to a scratch file and then transposed from there.
+      */
+      string scratchname = O.outfile + ".scratch";
+      {
+	options S(O);
+	S.compression = false;
+	S.qstep = 0.;
+	H5File scratch( scratchname.c_str(), H5F_ACC_TRUNC,H5P_DEFAULT,fapl );
+	process_perms( S, nmarkers, ofile, scratch );
+	transpose_perms( O, scratch, ofile );
+      }
+      remove( scratchname.c_str() );
+    }
+  else
+    {
+      process_perms( O, nmarkers, ofile, ofile );
+    }
     if ( O.verbose )
     {
       cerr << "I finished processing perms" <<"\n";
@@ -117,14 +210,21 @@ options process_argv( int argc, char ** argv )
     ("noconvert","Do not convert input into a p-value.  Default is to assume that the input is a chi^2 statistic with 1 degree of freedom")
     ("bim,b",value<string>(&rv.bimfile)->default_value(string()),"The bim file (map file for binary PLINK data)")
     ("linkage,l",value<string>(&rv.ldfile)->default_value(string()),"The LD file (pairwise r^2 from PLINK)")
-    ("infile,i",value<string>(&rv.infile)->default_value(string()),"Input file name containing permutations.  Default is to read from stdin")
+    ("infile,i",value<string>(&rv.infile)->default_value(string()),"Input file name containing permutations, plain or gzip/zstd-compressed.  Default is to read from stdin")
     ("outfile,o",value<string>(&rv.outfile)->default_value(string()),"Output file name.  Format is HDF5")
     ("nrecords,n",value<size_t>(&rv.nrecords)->default_value(1),"Number of records to buffer.")
     ("ccache,a",value<size_t>(&rv.ccache)->default_value(5),"Raw data chunk cache in mega bytes(will be converted to bytes), default = 5MB")
     ("cmarkers,m",value<size_t>(&rv.cmarkers)->default_value(50),"Number of markers in a chunk")
-    ("compression,c","Gzip level 6 + shuffle compression")
+    ("compression,c","Shuffle + compression, gzip level 6 unless --codec says otherwise")
+    ("codec",value<string>(&rv.codec)->default_value("deflate"),"With -c, how the perms are compressed after the shuffle: deflate, lz4 or zstd (those that were built in).  lz4 and zstd write about 4 times as fast as deflate, and read faster, for files up to 10% bigger.  Default = deflate")
+    ("clevel",value<int>(&rv.clevel)->default_value(0),"Compression level of --codec, default = 0, the codec's default: 6 for deflate, 1 for zstd.  lz4 has no levels")
     ("nochunk","Chunked storage, default is true, false=contiguous")
     ("dbprec","ESM base type set to double")
+    ("transpose","Store the perms as /Perms/permutations_T, which is [markers x perms], so that esmk reads contiguous blocks of markers")
+    ("tperms",value<size_t>(&rv.tperms)->default_value(10000),"Number of perms in a chunk of /Perms/permutations_T, default = 10000")
+    ("tbudget",value<size_t>(&rv.tbudget)->default_value(1024),"Memory budget for --transpose in mega bytes, default = 1024MB")
+    ("quantize,q",value<double>(&rv.qstep)->default_value(0.),"Store the perms as 16-bit integers, rounded to multiples of this, e.g. 0.001 (so values above 65.535 are capped), which halves the file.  Default = 0, store them as floats")
+    ("threads,t",value<unsigned>(&rv.nthreads)->default_value(max(thread::hardware_concurrency(),1u)),"Number of threads parsing, converting and compressing the perms, default = number of cores")
     ("verbose,v","Write process info to STDERR")
     ;
 
@@ -178,6 +278,30 @@ options process_argv( int argc, char ** argv )
     {
       rv.dbprec = true;
     }
+  if (vm.count("transpose"))
+    {
+      rv.transpose = true;
+    }
+  if( !(rv.qstep >= 0.) )
+    {
+      cerr << "Error: --quantize must be >= 0.\n";
+      exit(10);
+    }
+  rv.filter = codec_filter( rv.codec );
+  if( rv.filter == H5Z_FILTER_NONE )
+    {
+      cerr << "Error: --codec " << rv.codec << " is not one of deflate, lz4 or zstd, or perms2h5 was built without it.\n";
+      exit(10);
+    }
+  if( rv.clevel == 0 )
+    {
+      rv.clevel = (rv.filter == H5Z_FILTER_DEFLATE) ? 6 : 1;
+    }
+  if( rv.filter == H5Z_FILTER_DEFLATE && (rv.clevel < 1 || rv.clevel > 9) )
+    {
+      cerr << "Error: --clevel must be from 1 to 9 for deflate.\n";
+      exit(10);
+    }
   return rv;
 }
 
@@ -260,15 +384,10 @@ size_t process_bimfile( const options & O, H5File & ofile )
   return markers.size();
 }
 
-void process_perms( const options & O, size_t nmarkers, H5File & ofile )
+void process_perms( const options & O, size_t nmarkers, H5File & ofile, H5File & permfile )
 {
-    FILE * ifp = !O.infile.empty() ? fopen( O.infile.c_str(),"r" ) : stdin;
-
-    if ( ifp == NULL )
-      {
-	cerr << "Error, input stream could not be opened.\n";
-	exit(10);
-      }
+    DumpReader in( O.infile );
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
 
     if ( O.verbose )
       {
@@ -277,25 +396,32 @@ void process_perms( const options & O, size_t nmarkers, H5File & ofile )
       }
     
     vector<ESMBASE> data(O.nrecords*nmarkers);
-    int repno;
-    fscanf(ifp,"%d",&repno);
+    long repno;
+    in.read_int(repno);
 
-    char * buffer = new char[100];
     //The first line is the observed data
     for( size_t i = 0 ; i < nmarkers ; ++i )
       {
-	int rv = fscanf(ifp,"%f",&data[i]);
-	if(O.convert)
+	if( !in.read_float(data[i]) )
 	  {
-	    data[i] = (data[i]!=1.) ? -log10(gsl_cdf_chisq_Q(data[i],1.)) : 0.;
+	    cerr << "Error, the observed data has fewer than " << nmarkers << " values.\n";
+	    exit(10);
 	  }
       }
+    if(O.convert)
+      {
+	convert_values( data.data(), nmarkers );
+      }
 
     if ( O.verbose )
       {
 	cerr << "Read in observed data.\n" << endl;
       }
     ofile.createGroup("/Perms");
+    if( permfile.getId() != ofile.getId() )
+      {
+	permfile.createGroup("/Perms");
+      }
 
     DSetCreatPropList cparms;
     hsize_t chunk_dims[1] = {nmarkers};
@@ -325,59 +451,283 @@ void process_perms( const options & O, size_t nmarkers, H5File & ofile )
     hsize_t maxdims2[2] = {H5S_UNLIMITED,nmarkers};
     hsize_t datadims[2] = {0,nmarkers};
     hsize_t offsetdims[2] = {0,0};
-    hsize_t recorddims[2] = {O.nrecords,nmarkers};
 
     cparms.setChunk( 2, chunk_dims2 );
+    if ( O.compression)
+      {
+	cparms.removeFilter( H5Z_FILTER_ALL );
+	set_compression( O, cparms );
+      }
 
     DataSpace fspace(2,datadims,maxdims2);
-    d = new DataSet(ofile.createDataSet("/Perms/permutations",
-					PredType::NATIVE_FLOAT,
+    d = new DataSet(permfile.createDataSet("/Perms/permutations",
+					perm_type(O),
 					fspace,
 					cparms));
+    set_quantization( O, *d );
+
+
+    /*
+      Records are written O.nrecords at a time.  As always, a last batch
+      of fewer than O.nrecords is dropped, unless the input stops right
+      after its last value with no newline.
+    */
+    ThreadPool pool(O.nthreads);
+    BoundedQueue< future<perm_batch> > batches(2*size_t(O.nthreads) + 2);
+    thread reader( [&]() {
+	while( true )
+	  {
+	    shared_ptr< vector<char> > text(new vector<char>());
+	    const size_t nrecs = in.read_records(O.nrecords,*text);
+	    if( nrecs == 0 || (nrecs < O.nrecords && !in.eof()) ) { break; }
+	    shared_ptr< promise<perm_batch> > done(new promise<perm_batch>());
+	    batches.push(done->get_future());
+	    pool.submit( [&O,nmarkers,nrecs,text,done]() {
+		done->set_value( process_batch(O,nmarkers,nrecs,*text) );
+	      } );
+	    if( in.eof() ) { break; }
+	  }
+	batches.close();
+      } );
 
-    
-    size_t RECSREAD = 0;
-    while(!feof(ifp))
+    future<perm_batch> next;
+    while( batches.pop(next) )
       {
-	int rv = 1;
-	size_t I = 0;
-	RECSREAD = 0;
-	for( size_t i = 0 ; !feof(ifp) && i < O.nrecords ; ++i,++RECSREAD )
+	perm_batch B = next.get();
+	if( !B.ok )
 	  {
-	    if ( O.verbose )
-	      {
-		cerr << i << ": ";
-	      }
-	    repno = -1;
-	    rv=fscanf(ifp,"%d",&repno);
-	    if( rv == 0 || rv == -1 || feof(ifp ) )
+	    cerr << "Error, a permutation in records " << datadims[0] << " to " << datadims[0] + B.nrecs - 1
+		 << " does not have " << nmarkers << " values.\n";
+	    exit(10);
+	  }
+	offsetdims[0] = datadims[0];
+	datadims[0] += B.nrecs;
+	d->extend( datadims );
+	for( size_t c = 0 ; c < B.chunks.size() ; ++c )
+	  {
+	    if( B.chunks[c].empty() )
 	      {
-	    	if( O.verbose ) cerr << "return 1\n";
-	    	return; //we have hit the end of the file
+		cerr << "Error, could not compress the permutations in records " << offsetdims[0] << " to "
+		     << datadims[0] - 1 << ".\n";
+		exit(10);
 	      }
-	    
-	    for( size_t j = 0 ; j < nmarkers ; ++j,++I )
+	    offsetdims[1] = c*O.cmarkers;
+	    if( H5Dwrite_chunk(d->getId(),H5P_DEFAULT,0,offsetdims,B.chunks[c].size(),B.chunks[c].data()) < 0 )
 	      {
-		if(O.verbose) cerr << j << ',' << I << ' ';
-		rv = fscanf(ifp,"%f",&data[I]);
-	
-		if(O.convert)
-		  {
-		    data[I]= (data[I] != 1.) ? -log10(gsl_cdf_chisq_Q(data[I],1.)) : 0.;
-		  }
+		cerr << "Error, could not write the permutations.\n";
+		exit(10);
 	      }
-	    if(O.verbose) cerr<< endl;
 	  }
-	datadims[0] += RECSREAD;
-	recorddims[0] = RECSREAD;
-	DataSpace memspace(2,recorddims);
-	d->extend( datadims );
-	DataSpace * dspace = new DataSpace( d->getSpace() );
-	dspace->selectHyperslab(H5S_SELECT_SET,recorddims,offsetdims);
-	d->write(data.data(), PredType::NATIVE_FLOAT,memspace,*dspace);
-	delete dspace;
-	offsetdims[0] += O.nrecords;
       }
+    reader.join();
+    delete d;
+    report_throughput( O, in, start );
+}
+
+perm_batch process_batch( const options & O, const size_t & nmarkers,
+			  const size_t & nrecs, const vector<char> & text )
+{
+  perm_batch rv;
+  rv.nrecs = nrecs;
+  vector<ESMBASE> data(nrecs*nmarkers);
+  rv.ok = parse_records(text.data(),text.data() + text.size(),nrecs,nmarkers,data.data());
+  if( !rv.ok ) { return rv; }
+  if(O.convert)
+    {
+      convert_values( data.data(), data.size() );
+    }
+  /*
+    Chunks are O.nrecords x O.cmarkers, including the last, short ones,
+    which are padded out.  With --compression they go through the same
+    filters HDF5 would use, shuffle and then O.filter at O.clevel.
+  */
+  const size_t size = (O.qstep > 0.) ? sizeof(uint16_t) : sizeof(float);
+  const size_t nelem = O.nrecords*O.cmarkers, nbytes = nelem*size;
+  vector<char> chunk(nbytes);
+  vector<char> shuffled(nbytes);
+  for( size_t m0 = 0 ; m0 < nmarkers ; m0 += O.cmarkers )
+    {
+      const size_t mc = min(O.cmarkers,nmarkers-m0);
+      fill(chunk.begin(),chunk.end(),0);
+      for( size_t r = 0 ; r < nrecs ; ++r )
+	{
+	  const ESMBASE * from = &data[r*nmarkers + m0];
+	  if( O.qstep > 0. )
+	    {
+	      quantize_values(from,mc,O.qstep,reinterpret_cast<uint16_t *>(&chunk[r*O.cmarkers*size]));
+	    }
+	  else
+	    {
+	      copy(from,from + mc,reinterpret_cast<float *>(&chunk[r*O.cmarkers*size]));
+	    }
+	}
+      const char * bytes = chunk.data();
+      if( !O.compression )
+	{
+	  rv.chunks.push_back( chunk );
+	  continue;
+	}
+      if( nelem > 1 )
+	{
+	  for( size_t b = 0 ; b < size ; ++b )
+	    {
+	      for( size_t i = 0 ; i < nelem ; ++i )
+		{
+		  shuffled[b*nelem + i] = bytes[i*size + b];
+		}
+	    }
+	}
+      else
+	{
+	  copy(bytes,bytes + nbytes,shuffled.begin());
+	}
+      rv.chunks.push_back( encode_chunk(O.filter,O.clevel,shuffled.data(),nbytes) );
+    }
+  return rv;
+}
+
+void convert_values( ESMBASE * data, const size_t & n )
+{
+  vector<ESMBASE> logp(n);
+  chisq1_log10p(data,logp.data(),n);
+  for( size_t i = 0 ; i < n ; ++i )
+    {
+      data[i] = (data[i] != 1.) ? logp[i] : 0.;
+    }
+}
+
+void quantize_values( const ESMBASE * data, const size_t & n,
+		      const double & step, uint16_t * q )
+{
+  const double inv = 1./step;
+  for( size_t i = 0 ; i < n ; ++i )
+    {
+      const double x = double(data[i])*inv + 0.5;
+      q[i] = (x >= 65535.) ? 65535 : ( (x >= 1.) ? uint16_t(x) : 0 );
+    }
+}
+
+const PredType & perm_type( const options & O )
+{
+  return (O.qstep > 0.) ? PredType::NATIVE_UINT16 : PredType::NATIVE_FLOAT;
+}
+
+void set_quantization( const options & O, DataSet & d )
+{
+  if( O.qstep <= 0. ) { return; }
+  const double offset = 0.;
+  DataSpace scalar(H5S_SCALAR);
+  d.createAttribute("scale",PredType::NATIVE_DOUBLE,scalar).write(PredType::NATIVE_DOUBLE,&O.qstep);
+  d.createAttribute("offset",PredType::NATIVE_DOUBLE,scalar).write(PredType::NATIVE_DOUBLE,&offset);
+}
+
+void set_compression( const options & O, DSetCreatPropList & cparms )
+{
+  cparms.setShuffle();
+  if( O.filter == H5Z_FILTER_DEFLATE )
+    {
+      cparms.setDeflate( O.clevel );
+    }
+  else if( O.filter == FILTER_ZSTD )
+    {
+      const unsigned level = unsigned(O.clevel);
+      cparms.setFilter( O.filter, H5Z_FLAG_MANDATORY, 1, &level );
+    }
+  else
+    {
+      cparms.setFilter( O.filter, H5Z_FLAG_MANDATORY );
+    }
+}
+
+void report_throughput( const options & O, const DumpReader & in,
+			const chrono::steady_clock::time_point & start )
+{
+  if ( O.verbose )
+    {
+      const double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+      const double MB = double(in.bytes())/(1024.*1024.);
+      cerr << "Read " << MB << " MB of permutations in " << secs << " s ("
+	   << MB/max(secs,1e-9) << " MB/s)\n";
+    }
+}
+
+void transpose_perms( const options & O, H5File & permfile, H5File & ofile )
+{
+  DataSet in = permfile.openDataSet("/Perms/permutations");
+  DataSpace inspace = in.getSpace();
+  hsize_t indims[2];
+  inspace.getSimpleExtentDims( indims, NULL );
+  const size_t nperms = indims[0], nmarkers = indims[1];
+
+  DSetCreatPropList cparms;
+  hsize_t chunk_dims[2] = { min(O.cmarkers,nmarkers), min(O.tperms,max(nperms,size_t(1))) };
+  hsize_t datadims[2] = { nmarkers, nperms };
+  hsize_t maxdims[2] = { nmarkers, H5S_UNLIMITED };
+  cparms.setChunk( 2, chunk_dims );
+  if ( O.compression)
+    {
+      set_compression( O, cparms );
+    }
+  DataSpace outspace(2,datadims,maxdims);
+  DataSet out = ofile.createDataSet("/Perms/permutations_T",
+				    perm_type(O),
+				    outspace,
+				    cparms);
+  set_quantization( O, out );
+
+  /*
+    Work in blocks of whole chunks of markers by as many perms as fit
+    in the budget.  Two copies of a block are held: as read, and transposed.
+  */
+  const size_t budget = O.tbudget*1024*1024/(2*sizeof(ESMBASE));
+  size_t bmarkers = (budget/max(nperms,size_t(1)))/size_t(chunk_dims[0])*size_t(chunk_dims[0]);
+  size_t bperms = nperms;
+  if( bmarkers == 0 )
+    {
+      bmarkers = size_t(chunk_dims[0]);
+      bperms = max( budget/bmarkers/size_t(chunk_dims[1]), size_t(1) )*size_t(chunk_dims[1]);
+    }
+  if ( O.verbose )
+    {
+      cerr << "Transposing " << nperms << " perms of " << nmarkers << " markers in blocks of "
+	   << bmarkers << " markers by " << bperms << " perms\n";
+    }
+  vector<ESMBASE> block, tblock;
+  vector<uint16_t> qblock;
+  for( size_t m0 = 0 ; m0 < nmarkers ; m0 += bmarkers )
+    {
+      const size_t mb = min(bmarkers,nmarkers-m0);
+      for( size_t p0 = 0 ; p0 < nperms ; p0 += bperms )
+	{
+	  const size_t pb = min(bperms,nperms-p0);
+	  block.resize(pb*mb);
+	  tblock.resize(pb*mb);
+	  hsize_t inoffset[2] = { p0, m0 }, incount[2] = { pb, mb };
+	  inspace.selectHyperslab(H5S_SELECT_SET,incount,inoffset);
+	  DataSpace inmem(2,incount);
+	  in.read( block.data(), PredType::NATIVE_FLOAT, inmem, inspace );
+	  for( size_t p = 0 ; p < pb ; ++p )
+	    {
+	      for( size_t m = 0 ; m < mb ; ++m )
+		{
+		  tblock[m*pb + p] = block[p*mb + m];
+		}
+	    }
+	  hsize_t outoffset[2] = { m0, p0 }, outcount[2] = { mb, pb };
+	  outspace.selectHyperslab(H5S_SELECT_SET,outcount,outoffset);
+	  DataSpace outmem(2,outcount);
+	  if( O.qstep > 0. )
+	    {
+	      qblock.resize(pb*mb);
+	      quantize_values( tblock.data(), tblock.size(), O.qstep, qblock.data() );
+	      out.write( qblock.data(), PredType::NATIVE_UINT16, outmem, outspace );
+	    }
+	  else
+	    {
+	      out.write( tblock.data(), PredType::NATIVE_FLOAT, outmem, outspace );
+	    }
+	}
+    }
 }
 
 void process_ldfile( const options & O, H5File & ofile )
@@ -493,27 +843,31 @@ if ( O.verbose )
 
 void firstprime (size_t & num)
 {
-  size_t count = 0;
-  bool prime = false;
-  while ( prime == false )
+  //trial division by odd numbers up to sqrt(num)
+  if ( num <= 2 )
     {
-      count = 0;
-
-      for (size_t i=2;i<num;i++)
+      num = 2;
+      return;
+    }
+  if ( num%2 == 0 )
+    {
+      num++;
+    }
+  while ( true )
+    {
+      bool prime = true;
+      for (size_t i=3;i*i<=num;i+=2)
         {
-
           if (num%i==0)
             {
-              count++;
+	      prime = false;
+	      break;
             }
         }
-      if ( count == 0 )
-        {
-          prime = true;
-        }
-      else
+      if ( prime )
         {
-          num++;
+          return;
         }
+      num += 2;
     }
 }
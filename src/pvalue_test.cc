@@ -0,0 +1,166 @@
+/*
+  Checks chisq1_log10p against a long double evaluation of
+  -log10 erfc(sqrt(x/2)) for x from 1e-40 to 3e38, checks the values
+  it gives for 0, negative numbers, inf and nan, and checks that the
+  array version (the AVX2 kernel, where the CPU has it) gives results
+  bit-identical to the scalar one.
+
+  Run by make check.  Returns 0 if all checks pass.
+*/
+
+#include <Pvalue.hpp>
+#include <iostream>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <cstring>
+
+using namespace std;
+
+namespace
+{
+  /*
+    -log10 Q(x) in long double: from erf for small z, where erfc is
+    close to 1, from erfc while it does not underflow, and from the
+    asymptotic series of erfc beyond that.
+  */
+  long double reference( const long double & x )
+  {
+    const long double z = sqrtl(x/2.L);
+    long double lnq;
+    if( z < 1.L )
+      {
+	lnq = log1pl(-erfl(z));
+      }
+    else if( z < 100.L )
+      {
+	lnq = logl(erfcl(z));
+      }
+    else
+      {
+	//erfc z = exp(-z^2)/(z sqrt(pi)) (1 - 1/2z^2 + 3/4z^4 - ...)
+	const long double u = 1.L/(2.L*z*z);
+	long double term = 1.L, s = 0.L;
+	for( int k = 1 ; k <= 8 ; ++k )
+	  {
+	    term *= -(2*k - 1)*u;
+	    s += term;
+	  }
+	lnq = -z*z - logl(z) - 0.5L*logl(3.14159265358979323846264338327950288L) + log1pl(s);
+      }
+    return -lnq/logl(10.L);
+  }
+
+  //x from 1e-40 to 3e38, evenly on the log scale, and at random
+  vector<float> positives( mt19937 & rng )
+  {
+    vector<float> x;
+    for( double lx = -40. ; lx < log10(3e38) ; lx += 0.01 )
+      {
+	x.push_back(float(pow(10.,lx)));
+      }
+    uniform_real_distribution<double> U(-40.,log10(3e38));
+    for( int i = 0 ; i < 20000 ; ++i )
+      {
+	x.push_back(float(pow(10.,U(rng))));
+      }
+    x.push_back(3e38f);
+    return x;
+  }
+}
+
+int main( void )
+{
+  mt19937 rng(20160208);
+  size_t nfailed = 0, nchecked = 0;
+
+  //The scalar version against the reference
+  const vector<float> x = positives(rng);
+  double maxrel = 0.;
+  for( size_t i = 0 ; i < x.size() ; ++i )
+    {
+      const double got = chisq1_log10p(double(x[i]));
+      const long double want = reference(x[i]);
+      const double rel = double(fabsl((got - want)/want));
+      maxrel = max(maxrel,rel);
+      ++nchecked;
+      if( !(rel < 1e-12) )
+	{
+	  ++nfailed;
+	  cerr << "chisq1_log10p(" << x[i] << ") = " << got << ", the reference gives "
+	       << double(want) << " (relative error " << rel << ")\n";
+	}
+    }
+  cerr << "largest relative error: " << maxrel << '\n';
+
+  //Values outside (0,inf)
+  const float specials[] = { 0.f, -0.f, -1e-40f, -1.f, -3e38f,
+			     -numeric_limits<float>::infinity(),
+			     numeric_limits<float>::infinity(),
+			     numeric_limits<float>::quiet_NaN() };
+  const double expected[] = { 0., 0., 0., 0., 0., 0.,
+			      numeric_limits<double>::infinity(),
+			      numeric_limits<double>::quiet_NaN() };
+  for( int i = 0 ; i < 8 ; ++i )
+    {
+      const double got = chisq1_log10p(double(specials[i]));
+      ++nchecked;
+      if( isnan(expected[i]) ? !isnan(got) : ( got != expected[i] || signbit(got) ) )
+	{
+	  ++nfailed;
+	  cerr << "chisq1_log10p(" << specials[i] << ") = " << got << ", expected " << expected[i] << '\n';
+	}
+    }
+
+  /*
+    The array version against the scalar one, bit for bit, on runs of
+    every length up to 40 (so every tail the kernel leaves to the
+    scalar loop), with the special values mixed in, and in place.
+  */
+  vector<float> all(x);
+  all.insert(all.end(),specials,specials + 8);
+  for( size_t len = 1 ; len <= 40 ; ++len )
+    {
+      for( size_t start = 0 ; start + len <= all.size() ; start += 997 )
+	{
+	  vector<float> in(all.begin() + start,all.begin() + start + len), out(len);
+	  for( size_t i = 0 ; i < len ; ++i )
+	    {
+	      swap(in[i],in[rng() % len]);
+	    }
+	  vector<float> inplace(in);
+	  chisq1_log10p(in.data(),out.data(),len);
+	  chisq1_log10p(inplace.data(),inplace.data(),len);
+	  for( size_t i = 0 ; i < len ; ++i )
+	    {
+	      const float want = float(chisq1_log10p(double(in[i])));
+	      ++nchecked;
+	      if( memcmp(&out[i],&want,sizeof(float)) || memcmp(&inplace[i],&want,sizeof(float)) )
+		{
+		  ++nfailed;
+		  cerr << "chisq1_log10p array of " << len << ": " << in[i] << " gives " << out[i]
+		       << " (in place " << inplace[i] << "), the scalar version " << want << '\n';
+		}
+	    }
+	}
+    }
+  //All of the values in one call, as perms2h5 makes it
+  vector<float> out(all.size());
+  chisq1_log10p(all.data(),out.data(),all.size());
+  for( size_t i = 0 ; i < all.size() ; ++i )
+    {
+      const float want = float(chisq1_log10p(double(all[i])));
+      ++nchecked;
+      if( memcmp(&out[i],&want,sizeof(float)) )
+	{
+	  ++nfailed;
+	  cerr << "chisq1_log10p array: " << all[i] << " gives " << out[i]
+	       << ", the scalar version " << want << '\n';
+	}
+    }
+
+  cerr << nchecked - nfailed << " of " << nchecked << " checks of chisq1_log10p pass\n";
+  return nfailed == 0 ? 0 : 1;
+}